@@ -0,0 +1,310 @@
+/*
+ * apl_bench: throughput of the scanner, the compiler and the VM on every program of unitTests/,
+ * each also repeated a few times over for a larger source.
+ * Every benchmark is timed in batches of operations sized to take at least --min-time, over a
+ * number of repetitions, and reported as the median, mean, standard deviation and minimum of the
+ * time per operation, with bytes of source per second and operator new calls per operation.
+ *
+ * Usage: apl_bench [--repetitions n] [--min-time ms] [--scale 1,4,16] [--filter text] [dir]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../headers/scanner.h"
+#include "../headers/compiler.h"
+#include "../headers/vm.h"
+#include "../headers/mappedfile.h"
+
+#ifndef APL_UNIT_TESTS
+#define APL_UNIT_TESTS "unitTests"
+#endif
+
+static size_t allocations = 0;
+
+void* operator new(size_t size){
+    allocations++;
+    if(void* memory = malloc(size ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size){
+    return operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocations++;
+    return malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+// only the scalar form frees, as only the scalar new allocates, so every new has its matching delete
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { operator delete(memory); }
+void operator delete(void* memory, size_t) noexcept { operator delete(memory); }
+void operator delete[](void* memory, size_t) noexcept { operator delete(memory); }
+void operator delete(void* memory, const std::nothrow_t&) noexcept { operator delete(memory); }
+void operator delete[](void* memory, const std::nothrow_t&) noexcept { operator delete(memory); }
+
+namespace {
+
+struct Options {
+    size_t repetitions{10};
+    double minTime{0.05}; // seconds per batch
+    std::vector<size_t> scales{1, 4, 16};
+    std::string filter;
+    std::string directory{APL_UNIT_TESTS};
+};
+
+struct Program {
+    std::string name;
+    std::string source;
+};
+
+// Time of one batch of `operations` operations, and the allocations it made
+struct Batch {
+    double seconds;
+    size_t allocations;
+};
+
+struct Summary {
+    double median, mean, deviation, min; // ns per operation
+    double allocations; // per operation
+};
+
+double now(){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The program's output would swamp the report, while a run stdout goes to /dev/null
+class QuietStdout {
+public:
+    QuietStdout(){
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    ~QuietStdout(){
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+private:
+    int saved;
+};
+
+// Grows the batch until it takes `minTime`, then times `repetitions` batches of that size
+template<class Run>
+Summary measure(const Options& options, Run run){
+    size_t operations = 1;
+    Batch batch = run(operations);
+    while(batch.seconds < options.minTime && operations < ((size_t)1 << 30)) {
+        if(batch.seconds < options.minTime / 10) operations *= 10;
+        else operations = operations * options.minTime * 1.2 / batch.seconds + 1;
+        batch = run(operations);
+    }
+    std::vector<double> times;
+    size_t allocated = 0;
+    for(size_t i = 0; i < options.repetitions; i++){
+        batch = run(operations);
+        times.push_back(batch.seconds * 1e9 / operations);
+        allocated += batch.allocations;
+    }
+    Summary summary{};
+    std::sort(times.begin(), times.end());
+    size_t middle = times.size() / 2;
+    summary.median = times.size() % 2 ? times[middle] : (times[middle - 1] + times[middle]) / 2;
+    for(double time : times) summary.mean += time / times.size();
+    for(double time : times) summary.deviation += (time - summary.mean) * (time - summary.mean);
+    summary.deviation = times.size() > 1 ? std::sqrt(summary.deviation / (times.size() - 1)) : 0;
+    summary.min = times.front();
+    summary.allocations = (double)allocated / (operations * options.repetitions);
+    return summary;
+}
+
+void printHeader(){
+    printf("%-8s %-28s %-7s %12s %12s %8s %12s %10s %10s\n",
+           "phase", "program", "op", "median ns", "mean ns", "stddev", "min ns", "MB/s", "allocs/op");
+}
+
+// `bytes` of source go through each operation
+void printRow(const char* phase, const std::string& program, const char* op, const Summary& summary, double bytes){
+    printf("%-8s %-28s %-7s %12.1f %12.1f %7.1f%% %12.1f %10.2f %10.2f\n", phase, program.c_str(), op,
+           summary.median, summary.mean, summary.mean > 0 ? 100 * summary.deviation / summary.mean : 0,
+           summary.min, bytes / summary.median * 1e9 / (1 << 20), summary.allocations);
+    fflush(stdout);
+}
+
+size_t countTokens(const std::string& source){
+    Scanner scanner;
+    scanner.init(source.data(), source.size());
+    size_t tokens = 1;
+    while(scanner.scanToken().type != TokenType::EOF) tokens++;
+    return tokens;
+}
+
+void benchScanner(const Options& options, const Program& program){
+    size_t tokens = countTokens(program.source);
+    Summary summary = measure(options, [&](size_t operations){
+        Scanner scanner;
+        size_t left = operations;
+        size_t before = allocations;
+        double start = now();
+        while(left > 0){
+            scanner.init(program.source.data(), program.source.size());
+            while(left > 0){
+                left--;
+                if(scanner.scanToken().type == TokenType::EOF) break;
+            }
+        }
+        return Batch{now() - start, allocations - before};
+    });
+    printRow("scan", program.name, "token", summary, (double)program.source.size() / tokens);
+}
+
+// Some programs of unitTests/ stop with an error or crash on purpose, so each is compiled and run
+// in a child process first and only timed as far as it got there.
+template<class Body>
+bool succeedsInChild(Body body){
+    fflush(stdout);
+    pid_t child = fork();
+    if(child < 0) return false;
+    if(child == 0){
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        alarm(10);
+        _exit(body() ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void benchCompiler(const Options& options, const Program& program){
+    Summary summary = measure(options, [&](size_t operations){
+        std::vector<Chunk> chunks(operations);
+        Compiler::Parser parser;
+        Compiler compiler{parser};
+        size_t before = allocations;
+        double start = now();
+        for(auto& chunk : chunks) compiler.compile(program.source.data(), program.source.size(), &chunk);
+        return Batch{now() - start, allocations - before};
+    });
+    printRow("compile", program.name, "compile", summary, program.source.size());
+}
+
+void benchVm(const Options& options, const Program& program, Chunk& chunk){
+    Summary summary = measure(options, [&](size_t operations){
+        // every run starts from fresh cells, as the program would from the command line
+        std::vector<std::unique_ptr<Vm>> vms;
+        for(size_t i = 0; i < operations; i++) {
+            vms.emplace_back(new Vm());
+            vms.back()->setDisassemble(false);
+        }
+        QuietStdout quiet;
+        size_t before = allocations;
+        double start = now();
+        for(auto& vm : vms) vm->interpret(chunk);
+        return Batch{now() - start, allocations - before};
+    });
+    printRow("run", program.name, "run", summary, program.source.size());
+}
+
+bool readPrograms(const Options& options, std::vector<Program>& programs){
+    DIR* directory = opendir(options.directory.c_str());
+    if(directory == nullptr) return false;
+    std::vector<std::string> names;
+    while(dirent* entry = readdir(directory)){
+        std::string name = entry->d_name;
+        if(name.size() > 4 && name.compare(name.size() - 4, 4, ".txt") == 0 &&
+           name.find(options.filter) != std::string::npos) names.push_back(name);
+    }
+    closedir(directory);
+    std::sort(names.begin(), names.end());
+    for(auto& name : names){
+        std::string path = options.directory + "/" + name;
+        MappedFile file(path.c_str());
+        if(!file.isOpen()) {
+            fprintf(stderr, "Can't open \"%s\".\n", path.c_str());
+            return false;
+        }
+        std::string source(file.data(), file.size());
+        if(!source.empty() && source.back() != '\n') source += '\n';
+        for(size_t scale : options.scales){
+            Program program{name, std::string()};
+            if(scale != 1) program.name += " x" + std::to_string(scale);
+            for(size_t i = 0; i < scale; i++) program.source += source;
+            programs.push_back(program);
+        }
+    }
+    return true;
+}
+
+void usage(){
+    fprintf(stderr, "Usage: apl_bench [--repetitions n] [--min-time ms] [--scale 1,4,16] [--filter text] [dir]\n");
+    exit(64);
+}
+
+bool parseScales(const char* list, std::vector<size_t>& scales){
+    scales.clear();
+    for(const char* at = list; *at; ){
+        char* end;
+        unsigned long scale = strtoul(at, &end, 10);
+        if(end == at || scale == 0) return false;
+        scales.push_back(scale);
+        at = *end == ',' ? end + 1 : end;
+        if(*end != ',' && *end != '\0') return false;
+    }
+    return !scales.empty();
+}
+
+}
+
+int main(int argc, const char* argv[]){
+    Options options;
+    int arg = 1;
+    for(; arg < argc && argv[arg][0] == '-'; arg++){
+        if(arg + 1 == argc) usage();
+        if(strcmp(argv[arg], "--repetitions") == 0) options.repetitions = std::max(1, atoi(argv[++arg]));
+        else if(strcmp(argv[arg], "--min-time") == 0) options.minTime = std::max(1, atoi(argv[++arg])) / 1000.0;
+        else if(strcmp(argv[arg], "--scale") == 0) { if(!parseScales(argv[++arg], options.scales)) usage(); }
+        else if(strcmp(argv[arg], "--filter") == 0) options.filter = argv[++arg];
+        else usage();
+    }
+    if(arg < argc - 1) usage();
+    if(arg == argc - 1) options.directory = argv[arg];
+
+    std::vector<Program> programs;
+    if(!readPrograms(options, programs)) {
+        fprintf(stderr, "Can't read the programs of \"%s\".\n", options.directory.c_str());
+        return 74;
+    }
+    printf("%zu repetitions, batches of at least %.0f ms\n\n", options.repetitions, options.minTime * 1000);
+    printHeader();
+    for(auto& program : programs){
+        benchScanner(options, program);
+        Vm vm;
+        Chunk chunk;
+        if(!succeedsInChild([&]{ return vm.compile(program.source.data(), program.source.size(), chunk); })) {
+            printf("%-8s %-28s does not compile, skipped\n", "compile", program.name.c_str());
+            continue;
+        }
+        benchCompiler(options, program);
+        vm.compile(program.source.data(), program.source.size(), chunk);
+        if(succeedsInChild([&]{ return vm.interpret(chunk) == InterpretResult::OK; })) benchVm(options, program, chunk);
+        else printf("%-8s %-28s stops with an error, skipped\n", "run", program.name.c_str());
+    }
+    return 0;
+}
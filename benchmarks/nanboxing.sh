@@ -0,0 +1,26 @@
+#!/bin/sh
+# Builds the interpreter with and without -DNAN_BOXING=ON and times both on the same programs.
+# Usage: benchmarks/nanboxing.sh [runs] [program...]   (from the repository root)
+set -e
+runs=${1:-5}
+[ $# -gt 0 ] && shift
+programs=${*:-benchmarks/values.txt}
+
+for config in union:OFF nanboxed:ON; do
+    name=${config%%:*}
+    cmake -S . -B "build-$name" -DCMAKE_BUILD_TYPE=Release -DNAN_BOXING=${config##*:} > /dev/null
+    cmake --build "build-$name" > /dev/null
+done
+
+for program in $programs; do
+    for name in union nanboxed; do
+        best=
+        for i in $(seq "$runs"); do
+            start=$(date +%s%N)
+            "build-$name/AddressProgrammingLanguage" "$program" > /dev/null
+            ms=$(( ($(date +%s%N) - start) / 1000000 ))
+            if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then best=$ms; fi
+        done
+        echo "$program $name: best of $runs ${best} ms"
+    done
+done
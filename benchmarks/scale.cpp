@@ -0,0 +1,280 @@
+/*
+ * apl_scale: generates programs that grow along one dimension at a time (length, named cells,
+ * labels, nested R statements, parts of one L{} loop) and reports how compile time, run time and
+ * peak resident memory grow with them.
+ * Every program is compiled and run in its own child process, so a crash or a limit of the VM is
+ * reported as such and the peak RSS is that program's alone; the child also generates it, so the
+ * source is included.
+ * Next to each time is its growth exponent from the previous size, log(t2/t1) / log(n2/n1):
+ * 1 is linear, above 1.3 is marked as super-linear.
+ *
+ * --emit writes every program into the directory, which is created if it is missing.
+ *
+ * Usage: apl_scale [--only dimension] [--max n] [--timeout s] [--csv file] [--emit dir]
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../headers/vm.h"
+
+namespace {
+
+// Programs of the language, `n` being the size along the dimension
+std::string lengthProgram(size_t n){
+    // one long loop body: n statements, n constants and jumps across all of them
+    std::string source = "'v = 0\nL{1 (1) 2 => i} l1, l2\n";
+    for(size_t k = 0; k < n; k++) source += "'v = 'v + " + std::to_string(k) + ".5 - 'i\n";
+    return source + "l1\nl2 ...\nprint 'v\n";
+}
+
+std::string cellsProgram(size_t n){
+    std::string source = "'v = 0\n";
+    for(size_t k = 0; k < n; k++) source += "'c" + std::to_string(k) + " = " + std::to_string(k) + ".25\n";
+    for(size_t k = 0; k < n; k++) source += "'v = 'v + 'c" + std::to_string(k) + "\n";
+    return source + "print 'v\n";
+}
+
+std::string labelsProgram(size_t n){
+    // every label is passed twice, the second time after a jump to the first one by name
+    std::string source = "'v = 0\n";
+    for(size_t k = 0; k < n; k++) source += "l" + std::to_string(k) + " ... 'v = 'v + 1\n";
+    return source + "PR {'v >= " + std::to_string(2 * n) + "} ! | l0\n";
+}
+
+std::string nestingProgram(size_t n){
+    // the R statement of each level replays the level before it
+    std::string source = "'a = 0\ns0 ... 'a = 'a + 1\ne0 ...\n";
+    for(size_t k = 1; k <= n; k++){
+        std::string level = std::to_string(k), previous = std::to_string(k - 1);
+        source += "s" + level + " ... R{a->a}s" + previous + ",e" + previous + "\ne" + level + " ...\n";
+    }
+    return source + "print 'a\n";
+}
+
+std::string loopPartsProgram(size_t n){
+    std::string source = "'v = 0\nL{";
+    for(size_t k = 0; k < n; k++) source += (k ? ", 1 (1) 10 => p" : "1 (1) 10 => p") + std::to_string(k);
+    return source + "} l1, l2\n'v = 'v + 'p0 + 'p" + std::to_string(n - 1) + "\nl1\nl2 ...\nprint 'v\n";
+}
+
+struct Dimension {
+    const char* name;
+    std::string (*program)(size_t n);
+    std::vector<size_t> sizes;
+};
+
+const std::vector<Dimension> dimensions = {
+    {"length", lengthProgram, {1000, 3000, 10000, 30000, 100000}},
+    {"cells", cellsProgram, {1000, 3000, 10000, 30000, 100000}},
+    {"labels", labelsProgram, {1000, 3000, 10000, 30000, 100000}},
+    {"nesting", nestingProgram, {10, 30, 100, 300, 1000}},
+    {"loop-parts", loopPartsProgram, {1000, 3000, 10000, 30000, 100000}},
+};
+
+enum class Status { OK, COMPILE_ERROR, RUNTIME_ERROR, CRASHED, TIMED_OUT, NOT_EMITTED };
+
+const char* statusName(Status status){
+    switch (status) {
+        case Status::OK: return "ok";
+        case Status::COMPILE_ERROR: return "compile error";
+        case Status::RUNTIME_ERROR: return "runtime error";
+        case Status::CRASHED: return "crashed";
+        case Status::TIMED_OUT: return "timed out";
+        case Status::NOT_EMITTED: return "not emitted";
+    }
+    return "";
+}
+
+// What the child sends back through its pipe
+struct Timing {
+    Status status;
+    size_t bytes; // of source
+    double compileSeconds, runSeconds;
+};
+
+struct Point {
+    size_t n;
+    Timing timing;
+    double peakMegabytes;
+};
+
+struct Options {
+    std::string only;
+    size_t max{SIZE_MAX};
+    unsigned timeout{60};
+    const char* csv{nullptr};
+    const char* emit{nullptr};
+};
+
+double now(){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The child exits with EMIT_FAILED when it can't write the program
+const int EMIT_FAILED = 74;
+
+bool emit(const Options& options, const Dimension& dimension, size_t n, const std::string& source){
+    std::string path = std::string(options.emit) + "/" + dimension.name + "-" + std::to_string(n) + ".txt";
+    FILE* file = fopen(path.c_str(), "w");
+    bool written = file && fwrite(source.data(), 1, source.size(), file) == source.size();
+    if(file) written = fclose(file) == 0 && written;
+    if(!written) fprintf(stderr, "Can't write \"%s\".\n", path.c_str());
+    return written;
+}
+
+void measureInChild(const Options& options, const Dimension& dimension, size_t n, int out){
+    std::string source = dimension.program(n);
+    if(options.emit && !emit(options, dimension, n, source)) _exit(EMIT_FAILED);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    Timing timing{Status::COMPILE_ERROR, source.size(), 0, 0};
+    Vm vm;
+    vm.setDisassemble(false);
+    Chunk chunk;
+    double start = now();
+    bool compiled = vm.compile(source.data(), source.size(), chunk);
+    timing.compileSeconds = now() - start;
+    if(compiled) {
+        start = now();
+        InterpretResult result = vm.interpret(chunk);
+        timing.runSeconds = now() - start;
+        timing.status = result == InterpretResult::OK ? Status::OK : Status::RUNTIME_ERROR;
+    }
+    if(write(out, &timing, sizeof(timing)) != sizeof(timing)) _exit(1);
+    _exit(0);
+}
+
+Point measure(const Options& options, const Dimension& dimension, size_t n){
+    Point point{n, Timing{Status::CRASHED, 0, 0, 0}, 0};
+    int channel[2];
+    if(pipe(channel) != 0) return point;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t child = fork();
+    if(child == 0){
+        close(channel[0]);
+        alarm(options.timeout);
+        measureInChild(options, dimension, n, channel[1]);
+    }
+    close(channel[1]);
+    if(child < 0) {
+        close(channel[0]);
+        return point;
+    }
+    Timing timing{};
+    bool reported = read(channel[0], &timing, sizeof(timing)) == sizeof(timing);
+    close(channel[0]);
+    int status = 0;
+    rusage usage{};
+    wait4(child, &status, 0, &usage);
+    if(reported) point.timing = timing;
+    else if(WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) point.timing.status = Status::TIMED_OUT;
+    else if(WIFEXITED(status) && WEXITSTATUS(status) == EMIT_FAILED) point.timing.status = Status::NOT_EMITTED;
+    point.peakMegabytes = usage.ru_maxrss / 1024.0; // kilobytes on Linux
+    return point;
+}
+
+// Growth exponent from the previous point, 0 where there is none
+double growth(const Point* previous, size_t n, double value, double previousValue){
+    if(!previous || previousValue <= 0 || value <= 0) return 0;
+    return std::log(value / previousValue) / std::log((double)n / previous->n);
+}
+
+std::string exponent(double value){
+    if(value == 0) return "";
+    char text[16];
+    snprintf(text, sizeof(text), "%.2f%s", value, value > 1.3 ? "!" : "");
+    return text;
+}
+
+std::string bar(double value, double max, size_t width){
+    return std::string(max > 0 ? (size_t)std::lround(width * value / max) : 0, '#');
+}
+
+void report(const Dimension& dimension, const std::vector<Point>& points){
+    printf("\n%s\n%10s %10s %12s %7s %12s %7s %9s %7s  %-14s %s\n", dimension.name, "n", "bytes",
+           "compile ms", "growth", "run ms", "growth", "peak MB", "growth", "status", "compile | run");
+    double maxTime = 0;
+    for(auto& point : points) maxTime = std::max({maxTime, point.timing.compileSeconds, point.timing.runSeconds});
+    const Point* previous = nullptr;
+    for(auto& point : points){
+        const Timing& timing = point.timing;
+        double compileGrowth = growth(previous, point.n, timing.compileSeconds, previous ? previous->timing.compileSeconds : 0);
+        double runGrowth = growth(previous, point.n, timing.runSeconds, previous ? previous->timing.runSeconds : 0);
+        double memoryGrowth = growth(previous, point.n, point.peakMegabytes, previous ? previous->peakMegabytes : 0);
+        printf("%10zu %10zu %12.2f %7s %12.2f %7s %9.1f %7s  %-14s %-20s| %s\n", point.n, point.timing.bytes,
+               timing.compileSeconds * 1000, exponent(compileGrowth).c_str(), timing.runSeconds * 1000,
+               exponent(runGrowth).c_str(), point.peakMegabytes, exponent(memoryGrowth).c_str(),
+               statusName(timing.status), bar(timing.compileSeconds, maxTime, 20).c_str(),
+               bar(timing.runSeconds, maxTime, 20).c_str());
+        fflush(stdout);
+        previous = timing.status == Status::OK ? &point : nullptr;
+    }
+}
+
+void usage(){
+    fprintf(stderr, "Usage: apl_scale [--only dimension] [--max n] [--timeout s] [--csv file] [--emit dir]\n"
+                    "--emit writes the programs into dir, creating it if it is missing\n"
+                    "dimensions:");
+    for(auto& dimension : dimensions) fprintf(stderr, " %s", dimension.name);
+    fprintf(stderr, "\n");
+    exit(64);
+}
+
+}
+
+int main(int argc, const char* argv[]){
+    Options options;
+    for(int arg = 1; arg < argc; arg++){
+        if(arg + 1 == argc) usage();
+        if(strcmp(argv[arg], "--only") == 0) options.only = argv[++arg];
+        else if(strcmp(argv[arg], "--max") == 0) options.max = strtoull(argv[++arg], nullptr, 10);
+        else if(strcmp(argv[arg], "--timeout") == 0) options.timeout = std::max(1, atoi(argv[++arg]));
+        else if(strcmp(argv[arg], "--csv") == 0) options.csv = argv[++arg];
+        else if(strcmp(argv[arg], "--emit") == 0) options.emit = argv[++arg];
+        else usage();
+    }
+    bool known = options.only.empty();
+    for(auto& dimension : dimensions) known = known || options.only == dimension.name;
+    if(!known) usage();
+
+    if(options.emit && mkdir(options.emit, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Can't create \"%s\": %s.\n", options.emit, strerror(errno));
+        return 74;
+    }
+    FILE* csv = nullptr;
+    if(options.csv && !(csv = fopen(options.csv, "w"))) {
+        fprintf(stderr, "Can't write \"%s\".\n", options.csv);
+        return 74;
+    }
+    if(csv) fprintf(csv, "dimension,n,bytes,compile_ms,run_ms,peak_mb,status\n");
+    bool emitted = true;
+    for(auto& dimension : dimensions){
+        if(!options.only.empty() && options.only != dimension.name) continue;
+        std::vector<Point> points;
+        for(size_t n : dimension.sizes)
+            if(n <= options.max) points.push_back(measure(options, dimension, n));
+        report(dimension, points);
+        for(auto& point : points)
+            emitted = emitted && point.timing.status != Status::NOT_EMITTED;
+        for(auto& point : points)
+            if(csv) fprintf(csv, "%s,%zu,%zu,%.3f,%.3f,%.1f,%s\n", dimension.name, point.n, point.timing.bytes,
+                            point.timing.compileSeconds * 1000, point.timing.runSeconds * 1000,
+                            point.peakMegabytes, statusName(point.timing.status));
+    }
+    if(csv && fclose(csv) != 0) return 74;
+    return emitted ? 0 : 74;
+}
@@ -0,0 +1,34 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "chunk.h"
+
+/*
+ * A chunk decoded into a list of instructions, for passes that insert, remove or
+ * replace code after compilation.
+ * Jumps keep their target as an instruction index, and labels point to instructions,
+ * so nothing needs to be patched by hand: assemble() lays the code out again, picks
+ * the shortest encoding of every jump and constant and moves labelMap and lines along.
+ */
+struct Instruction {
+    byte op;          // OP_CONSTANT and the generic OP_JUMP / OP_JUMP_IF_FALSE stand for every width
+    uint32_t operand; // constant index, slot, or for jumps the index of the target instruction
+    int line;
+};
+
+class Assembly {
+public:
+    std::vector<Instruction> instructions;
+    std::vector<std::pair<std::string, size_t>> labels; // label name, instruction index
+
+    explicit Assembly(const Chunk& chunk);
+    void assemble(Chunk& chunk) const; // replaces chunk code, lines and labelMap
+
+    void remove(const std::vector<bool>& removed); // jumps and labels to a removed instruction move to the next one
+};
+
+
+#endif //ASSEMBLER_H
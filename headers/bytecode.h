@@ -0,0 +1,29 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <cstdint>
+#include "chunk.h"
+
+/*
+ * .apc files: a compiled chunk that runs without the compiler.
+ * All integers are little-endian:
+ *   "APC" '\0', uint32 version
+ *   uint32 counts of code bytes, line runs, strings, slots, constants, labels, loops
+ *   code
+ *   line runs: uint32 line, uint32 number of code bytes on it
+ *   strings in id order: uint32 length, characters
+ *   slots in order: uint32 id of the string named by the slot
+ *   constants: uint8 ValueType, then a double (NUMBER) or a uint32 string id (STRING)
+ *   labels: uint32 length, characters, uint32 code offset
+ *   loops: uint32 parts, per part its parameter as a constant, uint32 sequences, 3 doubles each
+ * Opcodes change between versions, so a file of another version is refused.
+ */
+const uint32_t BYTECODE_VERSION = 2;
+
+// Both report failures on stderr unless `quiet`
+bool writeBytecode(const Chunk& chunk, const char* path, bool quiet = false);
+// Returns false when the file is missing, of another version or damaged
+bool readBytecode(const char* path, Chunk& chunk, bool quiet = false);
+
+
+#endif //BYTECODE_H
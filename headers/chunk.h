@@ -3,10 +3,12 @@
 
 
 #include <cstdint>
+#include <cstdio>
 #include <vector>
 #include <string>
 #include <map>
-
+#include <unordered_map>
+#include "stringpool.h"
 
 
 
@@ -35,7 +37,19 @@ enum OpCode {
     OP_JUMP,
     OP_EXCHANGE,
     OP_JUMP_IF_FALSE_TO_LABEL,
-    OP_GET_LABEL
+    OP_GET_LABEL,
+    OP_JUMP_WIDE, // signed 16-bit distance, forward or backward
+    OP_JUMP_IF_FALSE_WIDE,
+    OP_GET_SLOT, // named cells with a compile-time slot, 16-bit operand
+    OP_SET_SLOT,
+    OP_CONSTANT_LONG, // 24-bit constant index
+    OP_JUMP_LONG, // signed 32-bit distance
+    OP_JUMP_IF_FALSE_LONG,
+    OP_LESS_EQUAL, // fused comparison and OP_NOT, emitted by optimize()
+    OP_GREATER_EQUAL,
+    OP_NOT_EQUAL,
+    OP_LOOP_PREPARE, // counted L{} loop, 16-bit index into Chunk::loops
+    OP_LOOP_STEP
 };
 enum class ValueType {
     NUMBER,
@@ -51,48 +65,165 @@ typedef uint8_t byte;
 #include "cstring"
 
 
+// Values are read and written through the same accessors in both encodings below.
+#ifdef NAN_BOXING
+// 8 bytes: a double, or a quiet NaN with a clear sign bit whose bits 48-49 tag the other types
+// and whose low 48 bits hold the pointer or the bool. A NaN computed at runtime is stored as the
+// hardware's default NaN, which the tags never take.
 struct Value {
-    ValueType type;
-    union {
-        bool boolean;
-        double number;
-        const char* string;
-        Value* pointTo;
+    inline explicit Value(bool value): bits(QUIET_NAN | TAG_BOOL | (uint64_t)value){};
+    inline explicit Value(double value){
+        memcpy(&bits, &value, sizeof(bits));
+        if((bits & (SIGN | QUIET_NAN)) == QUIET_NAN) bits = DEFAULT_NAN;
+    };
+    inline explicit Value(Value* value): bits(QUIET_NAN | TAG_POINTER | (uint64_t)(uintptr_t)value){};
+    inline explicit Value(const char* value): bits(QUIET_NAN | TAG_STRING | (uint64_t)(uintptr_t)value){};
+    inline static Value Boxed(Value* pointee){
+        Value p(pointee);
+        p.bits = QUIET_NAN | TAG_BOXED | (uint64_t)(uintptr_t)pointee;
+        return p;
+    }
+    inline explicit Value(): bits(QUIET_NAN | TAG_POINTER){};
+
+    inline bool isNumber() const { return (bits & (SIGN | QUIET_NAN)) != QUIET_NAN; }
+    inline ValueType type() const {
+        if(isNumber()) return ValueType::NUMBER;
+        switch (bits & TAG) {
+            case TAG_BOOL: return ValueType::BOOL;
+            case TAG_POINTER: return ValueType::POINTER;
+            case TAG_STRING: return ValueType::STRING;
+            default: return ValueType::BOXED;
+        }
+    }
+    inline double number() const {
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    inline bool boolean() const { return bits & 1; }
+    inline const char* string() const { return (const char*)(uintptr_t)(bits & PAYLOAD); }
+    inline Value* pointTo() const { return (Value*)(uintptr_t)(bits & PAYLOAD); }
+    inline void setPointTo(Value* pointee){ bits = (bits & ~PAYLOAD) | (uint64_t)(uintptr_t)pointee; } // keeps the type
+
+    bool operator== (const Value& other) const;
+    void printValue(FILE* out = stdout) const;
+    explicit operator std::string() const;
 
-    } val;
-    inline explicit Value(bool value): type(ValueType::BOOL), val({.boolean = value}){};
-    inline explicit Value(double value): type(ValueType::NUMBER), val({.number = value}){};
-    inline explicit Value(Value* value): type(ValueType::POINTER), val({.pointTo = value}){};
-    inline explicit Value(const char* value): type(ValueType::STRING), val({.string = value}){};
+private:
+    static const uint64_t SIGN = 0x8000000000000000;
+    static const uint64_t QUIET_NAN = 0x7ffc000000000000;
+    static const uint64_t DEFAULT_NAN = 0x7ff8000000000000;
+    static const uint64_t TAG = 0x0003000000000000;
+    static const uint64_t TAG_BOOL = 0x0000000000000000;
+    static const uint64_t TAG_POINTER = 0x0001000000000000;
+    static const uint64_t TAG_STRING = 0x0002000000000000;
+    static const uint64_t TAG_BOXED = 0x0003000000000000;
+    static const uint64_t PAYLOAD = 0x0000ffffffffffff; // user-space pointers fit in 48 bits
+
+    uint64_t bits;
+};
+static_assert(sizeof(Value) == 8, "a NaN-boxed value is one word");
+#else
+struct Value {
+    inline explicit Value(bool value): tag(ValueType::BOOL), as({.boolean = value}){};
+    inline explicit Value(double value): tag(ValueType::NUMBER), as({.number = value}){};
+    inline explicit Value(Value* value): tag(ValueType::POINTER), as({.pointTo = value}){};
+    inline explicit Value(const char* value): tag(ValueType::STRING), as({.string = value}){};
     inline static Value Boxed(Value* pointee){
         Value p(pointee);
-        p.type = ValueType::BOXED;
+        p.tag = ValueType::BOXED;
         return p;
     }
-    inline explicit Value():type{ValueType::POINTER}, val({.pointTo = nullptr}) {};
+    inline explicit Value():tag{ValueType::POINTER}, as({.pointTo = nullptr}) {};
+
+    inline bool isNumber() const { return tag == ValueType::NUMBER; }
+    inline ValueType type() const { return tag; }
+    inline double number() const { return as.number; }
+    inline bool boolean() const { return as.boolean; }
+    inline const char* string() const { return as.string; }
+    inline Value* pointTo() const { return as.pointTo; }
+    inline void setPointTo(Value* pointee){ as.pointTo = pointee; } // keeps the type
+
     bool operator== (const Value& other) const;
-    void printValue() const;
+    void printValue(FILE* out = stdout) const;
     explicit operator std::string() const;
+
+private:
+    ValueType tag;
+    union {
+        bool boolean;
+        double number;
+        const char* string;
+        Value* pointTo;
+
+    } as;
 };
+#endif
 
 //typedef double Value;
 
+// An L{} loop whose ranges are all number constants, run by OP_LOOP_PREPARE and OP_LOOP_STEP.
+// Each part steps one parameter through its sequences `init (step) end` one after another.
+struct LoopSequence {
+    double init, step, end;
+};
+struct LoopPart {
+    Value parameter; // cell name or numeric address
+    std::vector<LoopSequence> sequences;
+};
+struct LoopDescriptor {
+    std::vector<LoopPart> parts;
+};
+
 
-const char* addString(const char* start, int length);
-const char* addString(const char* start);
-const char* addNumString(double value);
-void freeStrings();
+// `count` code bytes in a row that come from `line`
+struct LineRun {
+    uint32_t count;
+    int line;
+};
 
 struct Chunk {
     std::vector<byte> code;
-    std::vector<int> lines;
+    std::vector<int> lines; // of each code byte while the chunk is written, `lineRuns` once it is final
+    std::vector<LineRun> lineRuns;
+    std::vector<size_t> lineRunEnds; // offset past each run, for lineAt()'s binary search
     std::vector<Value> constants;
 
     void write(byte val, int line);
     void write(Chunk& chunk);
+    void writeConstant(Value value, int line);
+    void writeConstantIndex(uint32_t index, int line);
+    void writeSlot(byte op, const char* name, int line);
     int addConstant(Value const_val);
-    inline size_t count(){ return  code.size(); }
+    inline size_t count() const { return  code.size(); }
+    size_t instructionLength(size_t offset) const;
+    uint32_t constantIndex(size_t offset) const;
+    static bool isJump(byte op);
+    size_t jumpTarget(size_t offset) const;
+    void setJumpTarget(size_t offset, size_t target);
+    void resolveLabels();
+    // Done writing: lines become runs and what only the compiler needs is released.
+    // A final chunk no longer changes.
+    void finalize();
+    inline bool isFinal() const { return final; }
+    int lineAt(size_t offset) const; // for error messages and the profiler
+    void setLineRuns(std::vector<LineRun> runs);
+    static const uint32_t UNBOUNDED_STACK = UINT32_MAX;
+    uint32_t maxStack{0}; // values pushed at most from an entry point on, set by finalize()
+    std::vector<size_t> entryPoints; // sorted: the start and every label, set by finalize()
+    bool isEntryPoint(size_t offset) const;
+    static std::vector<LineRun> runsOf(const std::vector<int>& lines);
     std::map<std::string, size_t> labelMap;
+    std::vector<LoopDescriptor> loops;
+    StringPool strings; // names and labels of this chunk, the names of cells have a slot
+    int lastConstant{-1}; // operand of the constant instruction written last
+
+    // numbers (by bit pattern) and interned strings already in `constants`
+    std::unordered_map<uint64_t, int> numberConstants;
+    std::unordered_map<const char*, int> stringConstants;
+
+private:
+    bool final{false};
 };
 
 
@@ -0,0 +1,69 @@
+#ifndef COMPILECACHE_H
+#define COMPILECACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "chunk.h"
+
+struct CompileCacheStats {
+    size_t hits;      // found in memory
+    size_t diskHits;  // loaded from the cache directory
+    size_t misses;    // compiled
+    size_t evictions;
+    size_t entries;
+    size_t bytes;     // estimated size of the cached chunks
+};
+
+/*
+ * Compiled chunks of Vm::interpret by a 128-bit hash of their source and compile options,
+ * so a source that is run again skips the compiler.
+ * Least recently used chunks go first once there are more than `maxEntries` or they take more than `maxBytes`.
+ * With a directory set, chunks are also kept there as .apc files named by their key,
+ * which carries them over to the next process.
+ */
+class CompileCache {
+public:
+    struct Key {
+        uint64_t low, high;
+        inline bool operator==(const Key& other) const { return low == other.low && high == other.high; }
+    };
+
+    static const size_t DEFAULT_ENTRIES = 64;
+    static const size_t DEFAULT_BYTES = 16 << 20;
+
+    static Key keyOf(const char* source, size_t length, uint32_t options);
+
+    std::shared_ptr<Chunk> find(const Key& key);
+    void insert(const Key& key, const std::shared_ptr<Chunk>& chunk);
+
+    void setLimits(size_t maxEntries, size_t maxBytes);
+    void setDirectory(const std::string& directory); // empty for none
+    CompileCacheStats stats() const;
+    void clear();
+
+private:
+    struct KeyHash {
+        inline size_t operator()(const Key& key) const { return key.low; }
+    };
+    struct Entry {
+        Key key;
+        std::shared_ptr<Chunk> chunk;
+        size_t bytes;
+    };
+
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    size_t maxEntries{DEFAULT_ENTRIES}, maxBytes{DEFAULT_BYTES};
+    std::string directory;
+    CompileCacheStats counters{};
+
+    std::string pathOf(const Key& key) const;
+    void remember(const Key& key, const std::shared_ptr<Chunk>& chunk);
+    void trim();
+};
+
+
+#endif //COMPILECACHE_H
@@ -2,13 +2,21 @@
 #define COMPILER_H
 
 
+#include <cstdio>
 #include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include "scanner.h"
 #include "chunk.h"
 
 
 
+struct ExpansionStats {
+    size_t hits;   // R statement bodies written again from an earlier compilation
+    size_t misses; // compiled
+};
+
 class Compiler {
 public:
 
@@ -16,9 +24,13 @@ public:
     struct Parser {
         Token current;
         Token previous;
-        bool hadError;
-        bool panicMode;
-        Scanner scanner;
+        bool hadError{false};
+        bool panicMode{false};
+        FILE* errors{stderr}; // where compile errors are reported
+        // tokens [next, end) of `tokens` are still ahead, EOF follows them
+        TokenBuffer* tokens{nullptr};
+        size_t next{0}, end{0};
+        ReplacementTable replacements;
 
         void errorAtCurrent(const char *errMsg);
         void errorAt(Token& token, const char *errMsg);
@@ -31,6 +43,7 @@ public:
 
         bool currentEqual(int num, ...) const;
         bool previousEqual(int num, ...) const;
+        void setTokens(TokenBuffer& buffer, size_t from, size_t to);
         void setReplacements(const std::vector<ReplaceTokens>& replacements);
     };
 
@@ -56,17 +69,31 @@ private:
 
 
     Parser& parser;
-    Chunk* chunk;
-    const char* source;
+    Chunk* chunk{nullptr};
+    TokenBuffer sourceTokens; // of the source given to compile()
+    TokenBuffer* tokens{nullptr}; // the range [from, to) of them is compiled
+    size_t from{0}, to{0};
+
+    // Compiled R statement bodies of the source, by token range and replacements,
+    // shared with the compilers of the bodies
+    struct Expansions {
+        std::unordered_map<std::string, std::unique_ptr<Chunk>> bodies;
+        ExpansionStats stats{};
+        int loops{0}; // L{} statements compiled so far, numbering the labels of each
+    };
+    Expansions sourceExpansions;
+    Expansions* expansions{&sourceExpansions};
 
     void writeByte(byte byte1);
     void writeBytes(byte byte1, byte byte2);
+    void writeShort(byte command, uint16_t operand);
     void write(Chunk& chunk);
     void writeConstant(Value value);
     void writeString(std::string s);
+    void writeCellName(std::string s);
     void writeReturn();
     size_t writeJump(byte command);
-    void patchJump(size_t commandIdx);
+    void patchJump(size_t jumpIdx);
 
 
 
@@ -102,11 +129,9 @@ private:
     static const ParseRule getInfixRule(TokenType type);
 
     struct ForLoopParts{
-        static int initLabel;
-        Chunk initialization, step, endCondition, parameter;
+        Chunk initialization, step, end, endCondition, parameter;
+        bool predicate{false}; // PR{} condition instead of an end value
         ForLoopParts* nextPart{nullptr};
-        int num;
-        inline ForLoopParts():num(initLabel++){};
         inline ~ForLoopParts(){
             delete nextPart;
         }
@@ -116,13 +141,18 @@ private:
     void writeInitPart(const std::vector<ForLoopParts*>& forLoopParts, std::string l1, int forLoopNumber);
     void writeIncrementPart(const std::vector<ForLoopParts*>& forLoopParts, int forLoopNumber);
     void writeConditionPart(const std::vector<ForLoopParts*>& forLoopParts, std::string  l2, int forLoopNumber);
+    bool countedLoop(const std::vector<ForLoopParts*>& forLoopParts, LoopDescriptor& loop);
+    void writeCountedLoop(LoopDescriptor& loop, std::string l1, std::string l2, int forLoopNumber);
 
 
 public:
-    bool compile(const char* source, Chunk* chunk);
+    bool compile(const char* source, size_t length, Chunk* chunk);
+    bool compile(FILE* source, Chunk* chunk); // read as far as the compiler has come
+    bool compile(TokenBuffer& tokens, size_t from, size_t to, Chunk* chunk);
     void compileExpression(Chunk* chunk);
     void compileConditionExpression(Chunk* chunk);
-    void compileUntil(std::string label);
+    size_t compileUntil(std::string label);
+    inline ExpansionStats expansionStats() const { return sourceExpansions.stats; }
 
 /*
  * expression -> assignment
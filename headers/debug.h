@@ -2,8 +2,11 @@
 #define DEBUG_H
 
 #include "chunk.h"
+#include "registers.h"
 
 void disassembleInstructions(const Chunk* chunk);
+const char* opcodeName(byte op);
+void disassembleRegisters(const Chunk* chunk, const RegisterCode* registers);
 
 
 #endif //DEBUG_H
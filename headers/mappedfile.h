@@ -0,0 +1,31 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Read-only view of a whole file. It is memory-mapped where the platform has mmap,
+ * elsewhere, and for pipes and devices, it is read into a buffer once.
+ * The data is not '\0'-terminated.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const char* path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    inline bool isOpen() const { return opened; }
+    inline const char* data() const { return start; }
+    inline size_t size() const { return length; }
+
+private:
+    bool opened{false}, mapped{false};
+    const char* start{nullptr};
+    size_t length{0};
+    std::vector<char> buffer; // when not mapped
+};
+
+
+#endif //MAPPEDFILE_H
@@ -0,0 +1,82 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "chunk.h"
+
+struct MemoryStats {
+    size_t cells;     // cells handed out by the arena
+    size_t blocks;    // arena blocks
+    size_t pages;     // pages of the numeric address space
+    size_t bytes;     // arena blocks + address space pages
+    size_t cellLimit; // 0 if unlimited
+};
+
+/*
+ * Storage for cells and the values they point to.
+ * Cells are carved out of fixed size blocks: growing adds a block and never moves
+ * a cell, so Value* handed out earlier stay valid. No malloc per cell.
+ */
+class CellArena {
+public:
+    static const size_t BLOCK_SIZE = 4096;
+    static const size_t DEFAULT_LIMIT = (size_t)1 << 26;
+
+    inline explicit CellArena(size_t limit = DEFAULT_LIMIT): limit(limit){}
+    CellArena(const CellArena&) = delete;
+    CellArena& operator=(const CellArena&) = delete;
+    inline ~CellArena(){ clear(); }
+
+    Value* allocate(const Value& value); // nullptr once the limit is reached
+    void clear();
+    inline void setLimit(size_t cells){ limit = cells; }
+    inline size_t getLimit() const { return limit; }
+    inline size_t size() const { return cells; }
+    inline size_t blockCount() const { return blocks.size(); }
+
+private:
+    std::vector<Value*> blocks;
+    size_t cells{0};
+    size_t limit;
+};
+
+/*
+ * Cells addressed by a number, e.g. '14 = 18.
+ * Whole addresses in [0, 2^32) live in a three level page table, so a lookup is three
+ * array indexings and allocation happens only when a page is touched for the first time.
+ * Negative, fractional or bigger addresses are kept in a sparse map. NaN would break its order:
+ * find() has no cell for it and at() must not be given it.
+ * A cell that was never assigned is a POINTER to nullptr, same as a fresh named cell.
+ */
+class AddressSpace {
+public:
+    static const int PAGE_BITS = 10;
+    static const int TABLE_BITS = 10;
+    static const int DIRECTORY_BITS = 32 - PAGE_BITS - TABLE_BITS;
+    static const size_t PAGE_SIZE = (size_t)1 << PAGE_BITS;
+
+    AddressSpace() = default;
+    AddressSpace(const AddressSpace&) = delete;
+    AddressSpace& operator=(const AddressSpace&) = delete;
+    inline ~AddressSpace(){ clear(); }
+
+    Value* find(double address);
+    Value& at(double address);
+    void clear();
+    inline size_t pageCount() const { return pages; }
+
+private:
+    typedef Value* Page;
+    typedef Page* Table;
+
+    Table directory[(size_t)1 << DIRECTORY_BITS]{};
+    std::map<double, Value> sparse;
+    size_t pages{0};
+
+    static bool isPaged(double address);
+};
+
+
+#endif //MEMORY_H
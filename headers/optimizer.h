@@ -0,0 +1,18 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "chunk.h"
+
+/*
+ * Peephole passes over a finished chunk (after Chunk::resolveLabels), run until nothing changes:
+ *  - folding of arithmetic, comparisons and negation on number constants,
+ *    and of conditional jumps on a known condition
+ *  - fused OP_LESS_EQUAL / OP_GREATER_EQUAL / OP_NOT_EQUAL for a comparison followed by OP_NOT
+ *  - removal of unreachable code after OP_RETURN and unconditional jumps
+ *  - jump threading: jumps to jumps go straight to the final target, jumps to OP_RETURN return
+ * labelMap and lines are kept in step by Assembly.
+ */
+void optimize(Chunk& chunk);
+
+
+#endif //OPTIMIZER_H
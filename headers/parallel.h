@@ -0,0 +1,60 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstdint>
+#include <vector>
+#include "chunk.h"
+
+/*
+ * Counted L{} loops whose iterations can run on several threads at once.
+ * analyzeLoop() reads the body once, the bytecode between the jump into it and the jump back to the
+ * step, and accepts it when it only
+ *  - reads named cells it does not write, its parameter among them,
+ *  - reads and writes numbered cells at addresses computed from the parameter and those names, and
+ *  - prints, compares, computes and takes forward jumps within the body.
+ * Which cells the addresses come to depends on the values at runtime. Vm::runParallel computes them
+ * for every iteration and checks that no iteration writes a cell another one reads or writes before it
+ * hands ranges of iterations out to the workers. Each range runs on a worker Vm with a stack of its own
+ * and prints into a buffer of its own, the buffers are written out in the order of the iterations.
+ */
+struct LoopExpression {
+    enum Kind : byte { CONSTANT, PARAMETER, SLOT, NEGATE, ADD, SUBTRACT, MULTIPLY, DIVIDE } kind;
+    double constant; // CONSTANT
+    uint32_t slot; // SLOT
+    uint32_t left, right; // index in ParallelLoop::expressions of the operands
+};
+
+struct LoopAccess {
+    uint32_t address; // expression of the numeric address
+    bool write;
+    bool conditional; // a forward jump in the body can skip it
+};
+
+struct ParallelLoop {
+    static const uint32_t NO_EXPRESSION = UINT32_MAX;
+    static const size_t MIN_ITERATIONS = 4096; // fewer run serially, the check would take about as long
+    static const size_t MAX_ITERATIONS = (size_t)1 << 26; // every iteration is checked before any runs
+
+    bool analyzed{false};
+    bool independent{false};
+    size_t prepare{0}; // offset of OP_LOOP_PREPARE
+    size_t step{0}, body{0}, end{0}; // of OP_LOOP_STEP, the body and its jump back to the step
+    uint32_t parameter{0}; // slot of the named cell the loop counts with
+    std::vector<LoopExpression> expressions; // every operand before the expression using it
+    std::vector<LoopAccess> accesses; // in the order of the body
+    std::vector<uint32_t> slotsRead; // named cells the body reads, but its parameter
+    std::vector<uint32_t> namesPrinted; // cells printed by name, but the parameter
+    // from the step to the end of the jump back to it, with OP_PART_END for the step so a worker's run()
+    // returns there; offsets in it are from the step
+    std::vector<byte> code;
+};
+
+// Fills `loop` for the loop whose OP_LOOP_PREPARE is at `prepare`; false when it has to run serially
+bool analyzeLoop(const Chunk& chunk, size_t prepare, ParallelLoop& loop);
+
+// Value of an address expression in the iteration where the parameter is `parameter`,
+// computed with the same operations the body does
+double evaluate(const ParallelLoop& loop, uint32_t expression, double parameter, const std::vector<Value*>& slots);
+
+
+#endif //PARALLEL_H
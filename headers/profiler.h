@@ -0,0 +1,74 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include "chunk.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+/*
+ * Execution counts and time of the stack VM for --profile: per opcode, per bytecode offset and per
+ * label region, the code from a label up to the next one.
+ * Vm::run only calls it in its profiling instantiation, a run without a profiler executes the
+ * same code as before. Time is in cycles of the time-stamp counter where there is one (x86),
+ * nanoseconds elsewhere; each instruction is charged until the next one is dispatched.
+ */
+class Profiler {
+public:
+    static inline uint64_t ticks(){
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+    static const char* tickUnit();
+
+    void begin(const Chunk& chunk); // before a chunk runs
+    inline void enter(size_t offset){ // before the instruction at `offset` runs
+        uint64_t now = ticks();
+        current->ticks += now - last;
+        current = &offsets[offset];
+        current->count++;
+        last = now;
+    }
+    void end(); // once the chunk stopped, folds its counters into the totals
+
+    void report(FILE* out, size_t hotSpots = 20) const;
+    bool writeJson(const char* path) const;
+
+private:
+    struct Counter {
+        uint64_t count, ticks;
+    };
+    struct Spot {
+        size_t run, offset;
+        byte op;
+        int line;
+        std::string label;
+        Counter counter;
+    };
+
+    const Chunk* chunk{nullptr};
+    std::vector<Counter> offsets; // of the running chunk, the last one takes the time before its first instruction
+    Counter* current{nullptr};
+    uint64_t last{0};
+
+    size_t runs{0};
+    Counter opcodes[OP_LOOP_STEP + 1]{};
+    std::vector<Spot> spots; // every offset that ran, of every chunk
+    std::map<std::string, Counter> labels;
+    Counter total{};
+};
+
+
+#endif //PROFILER_H
@@ -0,0 +1,66 @@
+#ifndef REGISTERS_H
+#define REGISTERS_H
+
+#include <cstdint>
+#include <vector>
+#include "chunk.h"
+
+/*
+ * Register form of a chunk, run by Vm::runRegisters instead of Vm::run.
+ * The value the stack VM keeps at depth n lives in register n, which is Vm::stack[n],
+ * so both machines can take over from each other at any statement.
+ * Constants and named cells are operands of the instruction that uses them instead of
+ * being pushed first, which leaves most expressions without any push or pop.
+ */
+enum RegisterOp : byte {
+    R_MOVE,          // a = b
+    R_NEGATE,        // a = op b
+    R_NOT,
+    R_ADD,           // a = b op c
+    R_SUBTRACT,
+    R_MULTIPLY,
+    R_DIVIDE,
+    R_LESS,
+    R_GREATER,
+    R_EQUAL,
+    R_LESS_EQUAL,
+    R_GREATER_EQUAL,
+    R_NOT_EQUAL,
+    R_SET_SLOT,      // cell of slot a = b
+    R_PRINT,         // print b
+    R_POP,           // jump to the label named by b, if it is one; a is the depth left
+    R_JUMP,          // jump to instruction a
+    R_JUMP_IF_FALSE, // jump to instruction a if b is falsey
+    R_JUMP_IF_FALSE_TO_LABEL, // jump to the label c if b is falsey; a is the depth left
+    R_STACK,         // run stack instruction a on the registers below depth b, c is its operand
+    R_RETURN,
+    R_PART_END
+};
+
+// An operand is a register, a constant or a named cell, told apart by its two top bits
+const uint32_t OPERAND_REGISTER = 0u << 30;
+const uint32_t OPERAND_CONSTANT = 1u << 30;
+const uint32_t OPERAND_SLOT = 2u << 30;
+const uint32_t OPERAND_KIND = 3u << 30;
+
+struct RegisterInstruction {
+    byte op;
+    uint32_t a, b, c;
+    uint32_t origin; // offset of the stack instruction it comes from, for lines and errors
+};
+
+struct RegisterCode {
+    static const uint32_t NO_ENTRY = UINT32_MAX;
+
+    std::vector<RegisterInstruction> code;
+    std::vector<Value> constants; // the chunk's constants, then true and false
+    // first instruction of the statement at a stack offset, where a label jump can land
+    std::vector<uint32_t> entries;
+};
+
+// Fails when the stack depth of the chunk is not the same on every path into an instruction,
+// the chunk then only runs on the stack VM.
+bool allocateRegisters(const Chunk& chunk, RegisterCode& registers);
+
+
+#endif //REGISTERS_H
@@ -1,7 +1,13 @@
 #ifndef SCANNER_H
 #define SCANNER_H
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
 #include <map>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #undef EOF
@@ -25,9 +31,10 @@ enum  class TokenType {
         TOKEN_VAR, TOKEN_WHILE, ERROR, TOKEN_EOF*/
 
 };
+const size_t TOKEN_TYPE_COUNT = (size_t)TokenType::PR + 1;
 
 struct Token {
-    TokenType type;
+    TokenType type{TokenType::NEW_LINE}; // a statement starts after one
     const char* start{nullptr};
     int length{0};
     int line{-1};
@@ -38,11 +45,38 @@ struct ReplaceTokens {
     Token with;
 };
 
+// Hashing and comparing tokens by their text
+struct TokenTextHash {
+    size_t operator()(const Token& token) const;
+};
+struct TokenTextEqual {
+    bool operator()(const Token& a, const Token& b) const;
+};
+
+/*
+ * Replacements of an R statement, looked up in constant time.
+ * Identifiers and numbers are replaced by their text, any other token by its type alone.
+ * The first replacement of a token wins.
+ */
+class ReplacementTable {
+public:
+    void add(const ReplaceTokens& replacement);
+    inline bool empty() const { return count == 0; }
+    const Token& replace(const Token& t) const;
+
+private:
+    Token byType[TOKEN_TYPE_COUNT];
+    bool hasType[TOKEN_TYPE_COUNT]{};
+    std::unordered_map<Token, Token, TokenTextHash, TokenTextEqual> identifiers, numbers;
+    size_t count{0};
+};
+
 class Scanner {
 
 
     const char* start;
     const char* current;
+    const char* end; // the source needs no terminating '\0', a mapped file has none
     int line;
 
 
@@ -59,17 +93,48 @@ class Scanner {
     TokenType checkKeyword(const char* with, TokenType type);
     TokenType identifierType();
     Token identifier();
-    Token scanTokenInner();
 
 public:
-    std::vector<ReplaceTokens> replacements;
     Scanner();
-    void init(const char* source);
+    void init(const char* source, size_t length, int line = 1);
     bool isAtEnd();
+    inline int lineNumber() const { return line; }
 
     Token errorToken(const char* message);
     Token scanToken();
 };
 
+/*
+ * A whole source scanned once, ending with its EOF token.
+ * The parser walks a range of it, so the body of an R statement is a range replayed with the
+ * statement's replacements instead of source text scanned again.
+ * Label declarations (`name...`) are indexed by name.
+ * A streamed source is scanned a line at a time, only as far as reach() and findLabel() need;
+ * the lines read are kept, their tokens point into them.
+ */
+class TokenBuffer {
+public:
+    static const size_t NO_LABEL = SIZE_MAX;
+
+    void scan(const char* source, size_t length);
+    void stream(FILE* in);
+    inline const Token& at(size_t i) const { return tokens[i]; }
+    inline size_t size() const { return tokens.size(); }
+    // Whether there is a token `i`, reading a streamed source up to it
+    bool reach(size_t i);
+    // Index of the name token of the first declaration of `name` in [from, to), or NO_LABEL
+    size_t findLabel(const Token& name, size_t from, size_t to);
+
+private:
+    std::vector<Token> tokens;
+    std::unordered_map<Token, std::vector<size_t>, TokenTextHash, TokenTextEqual> labels; // ascending token indices
+    FILE* in{nullptr}; // of a streamed source, until its EOF token is scanned
+    std::deque<std::string> lines;
+    int line{1};
+
+    void append(const char* source, size_t length);
+    bool scanLine();
+};
+
 
 #endif //SCANNER_H
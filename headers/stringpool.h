@@ -0,0 +1,65 @@
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*
+ * Hash-consed strings of one compilation unit (a Chunk).
+ * Each distinct string is stored once and gets a dense id in insertion order,
+ * so two interned names are equal iff their pointers are equal.
+ * Strings that can name a cell also get a slot, dense in the order addSlot() gives them,
+ * labels and other strings don't take up room in the VM's slot table.
+ * The id and the slot are stored right before the characters: idOf() and slotOf() need no lookup.
+ * Everything is released together with the pool.
+ */
+class StringPool {
+public:
+    StringPool() = default;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    inline ~StringPool(){ clear(); }
+
+    const char* intern(const char* start, size_t length);
+    inline const char* intern(const char* s){ return intern(s, strlen(s)); }
+    inline const char* intern(const std::string& s){ return intern(s.c_str(), s.size()); }
+    inline const char* at(uint32_t id) const { return byId[id]; }
+    inline size_t size() const { return byId.size(); }
+    static uint32_t idOf(const char* interned);
+
+    static const uint32_t NO_SLOT = UINT32_MAX;
+    uint32_t addSlot(const char* interned); // the string's slot, given on the first call
+    static uint32_t slotOf(const char* interned); // NO_SLOT unless addSlot() gave it one
+    inline const char* atSlot(uint32_t slot) const { return bySlot[slot]; }
+    inline size_t slotCount() const { return bySlot.size(); }
+    void clear();
+
+private:
+    static const size_t BLOCK_SIZE = 4096;
+
+    struct Key {
+        const char* start;
+        size_t length;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+    struct KeyEqual {
+        bool operator()(const Key& a, const Key& b) const;
+    };
+
+    std::unordered_map<Key, uint32_t, KeyHash, KeyEqual> table;
+    std::vector<const char*> byId;
+    std::vector<const char*> bySlot;
+    std::vector<char*> blocks;
+    size_t blockUsed{BLOCK_SIZE};
+
+    char* allocate(size_t size);
+};
+
+
+#endif //STRINGPOOL_H
@@ -0,0 +1,49 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of worker threads, each with its own deque of tasks.
+ * submit() deals tasks out round robin; a worker runs its newest task first and, once its own
+ * deque is empty, steals the oldest task of another worker, so a few long tasks do not leave
+ * the other threads idle.
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads); // 0 is one per hardware thread
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool(); // runs every task submitted before
+
+    void submit(std::function<void()> task);
+    void wait(); // until every task submitted so far has run
+    inline size_t size() const { return workers.size(); }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues; // one per worker
+    std::vector<std::thread> workers;
+    std::mutex lock; // guards the counters below, taken before a queue's lock
+    std::condition_variable wake, idle;
+    size_t queued{0}; // tasks in the queues
+    size_t pending{0}; // tasks submitted and not finished
+    size_t next{0}; // queue of the next submit
+    bool stopping{false};
+
+    bool take(size_t self, std::function<void()>& task);
+    void work(size_t self);
+};
+
+
+#endif //THREADPOOL_H
@@ -3,9 +3,16 @@
 
 
 #include <map>
+#include <memory>
 #include <string>
 #include "chunk.h"
 #include "compiler.h"
+#include "compilecache.h"
+#include "memory.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "registers.h"
+#include "threadpool.h"
 
 
 enum class InterpretResult {
@@ -14,42 +21,109 @@ enum class InterpretResult {
     RUNTIME_ERROR
 };
 
+enum class Backend {
+    STACK,
+    REGISTER // Vm::runRegisters, for chunks allocateRegisters can translate
+};
+
 #define STACK_MAX 256
 class Vm {
 
     Chunk* chunk{NULL};
-    size_t ip;
+    const byte* code{nullptr}; // of `chunk`, read by run() without going through it
+    const Value* constants{nullptr};
+    size_t ip{0};
+    const RegisterCode* registers{nullptr};
+    Profiler* profiler{nullptr}; // set by --profile, run() then counts every instruction
+    FILE* out{stdout}; // what the program prints
+    FILE* errors{stderr}; // compile and runtime errors
 
     Value stack[STACK_MAX];
     size_t stackCount{0};
-    Value memory[STACK_MAX];
-    size_t memorySize{0};
+    CellArena memory;
 
     Compiler::Parser p;
     Compiler compiler{p};
-    std::map<std::string , Value*> pMap;
+    CompileCache compileCache; // chunks of interpret(source), by their source
+    std::map<std::string , Value*> pMap; // named cells kept between runs, and those of names without a slot
+    AddressSpace ownAddresses;
+    AddressSpace& addresses{ownAddresses}; // cells with a numeric name, a worker's are those of the Vm it runs for
+    bool aliasedAddresses{false}; // a numbered cell was made to share the value of a named one
+    std::vector<Value*> slots; // cells of the running chunk, indexed by the slot of their interned name
+    std::vector<std::vector<uint32_t>> loopSequences; // current sequence of each part of the chunk's counted loops
+    std::vector<ParallelLoop> parallelLoops; // of the chunk's counted loops, analyzed when they first run
+    size_t threads{0}; // for independent loop iterations, 0 is one per hardware thread
+    std::unique_ptr<ThreadPool> pool; // started by the first loop that runs on it
 
     void runtimeError(const char* format, ...);
 
 
     byte readByte();
+    uint16_t readShort();
+    uint32_t readLong();
+    bool stackFits();
     void push(Value value);
     Value pop();
     Value peek(size_t distance);
     InterpretResult setPointer(bool inverse, bool push);
     InterpretResult getPointer();
-    Value* stringToPointer(std::string s);
+    bool isAddress(double address);
+    InterpretResult pointTo(Value* pointer, const Value& pointee);
+    Value* stringToPointer(const char* name);
+    Value*& cellFor(const char* name);
+    void bindSlots();
+    void unbindSlots();
+    Value* loopValue(const Value& parameter);
+    InterpretResult loopPrepare(uint16_t loop);
+    InterpretResult loopStep(uint16_t loop);
+    InterpretResult loopTest(uint16_t loop);
+    bool runParallel(uint16_t loop, size_t prepare);
+    Vm(Vm& owner, const ParallelLoop& loop, FILE* out); // a worker of runParallel
+    void runIterations(const ParallelLoop& loop, double first, double step, size_t count);
+
+    static const size_t NO_JUMP = SIZE_MAX;
+    bool add(Value a, Value b, Value& sum);
+    InterpretResult exchange();
+    InterpretResult getLabel();
+    InterpretResult labelTarget(const char* name, size_t& target);
+    bool declaredLabel(const Value& v, size_t& target);
 
     static bool isFalsey(Value value);
     Value* addToMemory(const Value& value);
 
-    InterpretResult run();
+    void link(Chunk& chunk); // a compiled chunk's labels, optimizations and tables
+    InterpretResult run(); // from ip
+    template<bool PROFILING> InterpretResult execute();
+    InterpretResult runRegisters();
+    const Value* operand(uint32_t operand);
+    InterpretResult runStackInstruction(const RegisterInstruction& instruction);
     bool programFinished =  false;
+    bool optimizeCode = false;
+    Backend backend = Backend::STACK;
+    bool disassemble = true; // list every chunk before it runs
 
 public:
-    InterpretResult interpret(const char* source);
+    Vm() = default;
+    inline InterpretResult interpret(const char* source){ return interpret(source, strlen(source)); }
+    InterpretResult interpret(const char* source, size_t length); // `source` needs no terminating '\0'
+    InterpretResult interpret(Chunk& chunk); // a compiled chunk, from compile() or readBytecode()
+    InterpretResult interpret(FILE* source); // one program, however many lines it takes
+    bool compile(const char* source, size_t length, Chunk& chunk);
+    bool compile(FILE* source, Chunk& chunk);
     void initVM();
     void freeVM();
+    void setOptimize(bool optimize);
+    void setProfiler(Profiler* profiler); // nullptr stops profiling; it is filled by every interpret() after this
+    void setBackend(Backend backend);
+    void setDisassemble(bool disassemble); // the benchmarks time runs without the listing
+    void setThreads(size_t threads); // 1 runs every loop serially
+    void setOutput(FILE* out, FILE* errors); // the listing still goes to std::cout
+    void setMemoryLimit(size_t cells);
+    MemoryStats memoryStats() const;
+    void setCompileCacheLimits(size_t entries, size_t bytes); // 0 entries turns the cache off
+    void setCompileCacheDirectory(const std::string& directory);
+    CompileCacheStats compileCacheStats() const;
+    ExpansionStats expansionStats() const;
 
 };
 
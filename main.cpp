@@ -1,41 +1,234 @@
-#include <iostream>
-#include <fstream>
-#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
 #include "headers/vm.h"
+#include "headers/bytecode.h"
+#include "headers/mappedfile.h"
+#include "headers/threadpool.h"
 
-Vm vm;
+// Settings from the command line, given to every Vm
+struct Options {
+    bool optimize{false};
+    Backend backend{Backend::STACK};
+    const char* cacheDirectory{nullptr};
+    size_t threads{0}; // for independent loop iterations
+};
 
-static void runFile(const char* path){
-    std::ifstream  in(path);
-    std::stringstream  buffer;
-    buffer << in.rdbuf();
-    std::string s = buffer.str();
-    const char* source = s.c_str();
-    in.close();
-    InterpretResult result = vm.interpret(source);
+static Profiler profiler;
+static const char* profileJson = nullptr; // set by --profile
+
+// Registered with atexit, so a program that stops on an error is reported too
+static void reportProfile(){
+    profiler.report(stderr);
+    if(!profiler.writeJson(profileJson)) fprintf(stderr, "Can't write the profile to \"%s\".\n", profileJson);
+}
+
+static void configure(Vm& vm, const Options& options){
+    vm.initVM();
+    vm.setOptimize(options.optimize);
+    vm.setBackend(options.backend);
+    vm.setThreads(options.threads);
+    if(options.cacheDirectory) vm.setCompileCacheDirectory(options.cacheDirectory);
+    if(profileJson) vm.setProfiler(&profiler);
+}
+
+// A line of any length, with its '\n'; false at the end of the input
+static bool readLine(FILE* in, std::string& line){
+    line.clear();
+    char buffer[4096];
+    while(fgets(buffer, sizeof(buffer), in)){
+        line += buffer;
+        if(line.back() == '\n') return true;
+    }
+    return !line.empty();
+}
+
+static bool isBytecode(const char* path){
+    size_t length = strlen(path);
+    return length > 4 && strcmp(path + length - 4, ".apc") == 0;
+}
+
+// Exit status of running the file; failures are reported on `errors`
+static int execute(Vm& vm, const char* path, FILE* errors){
+    InterpretResult result;
+    if(isBytecode(path)){
+        Chunk chunk;
+        bool quiet = errors != stderr; // readBytecode only reports on stderr
+        if(!readBytecode(path, chunk, quiet)) {
+            if(quiet) fprintf(errors, "Can't read the bytecode of \"%s\".\n", path);
+            return 65;
+        }
+        result = vm.interpret(chunk);
+    } else {
+        // the compiler reads the source straight from the mapping
+        MappedFile source(path);
+        if(!source.isOpen()) {
+            fprintf(errors, "Can't open \"%s\".\n", path);
+            return 74;
+        }
+        result = vm.interpret(source.data(), source.size());
+    }
+    if (result == InterpretResult::COMPILE_ERROR) return 65;
+    if(result == InterpretResult::RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+static void runFile(Vm& vm, const char* path){
+    int status = execute(vm, path, stderr);
+    if(status != 0) exit(status);
+}
+
+// Standard input is one program, the same as a file: the compiler scans it a line at a time as it
+// arrives instead of waiting for all of it, and the program runs once the input ends.
+static void runStream(Vm& vm) {
+    InterpretResult result = vm.interpret(stdin);
     if (result == InterpretResult::COMPILE_ERROR) exit(65);
     if(result == InterpretResult::RUNTIME_ERROR) exit(70);
 }
 
-static void repl() {
-    char line[1024];
+static void compileFile(Vm& vm, const char* path, const char* output){
+    MappedFile source(path);
+    if(!source.isOpen()) {
+        fprintf(stderr, "Can't open \"%s\".\n", path);
+        exit(74);
+    }
+    Chunk chunk;
+    if(!vm.compile(source.data(), source.size(), chunk)) exit(65);
+    if(!writeBytecode(chunk, output)) exit(74);
+}
+
+static void repl(Vm& vm) {
+    std::string line;
     while (true){
         printf("> ");
 
-        if(!fgets(line, sizeof (line), stdin)){
+        if(!readLine(stdin, line)){
             printf("\n");
             break;
         }
-        vm.interpret(line);
+        vm.interpret(line.data(), line.size());
+    }
+
+}
+
+// What one file of a batch printed, written out once every file before it is
+struct BatchResult {
+    std::string out, errors;
+    int status{0};
+};
+
+static std::string takeText(FILE* stream, char*& text, size_t& size){
+    fclose(stream);
+    std::string taken(text, size);
+    free(text);
+    return taken;
+}
+
+// Each file gets a Vm of its own, with no listing, printing into memory
+static BatchResult runBatchFile(const char* path, const Options& options){
+    BatchResult result;
+    char* outText = nullptr;
+    char* errorText = nullptr;
+    size_t outSize = 0, errorSize = 0;
+    FILE* out = open_memstream(&outText, &outSize);
+    FILE* errors = open_memstream(&errorText, &errorSize);
+    if(!out || !errors) {
+        if(out) takeText(out, outText, outSize);
+        if(errors) takeText(errors, errorText, errorSize);
+        result.errors = std::string("Can't run \"") + path + "\".\n";
+        result.status = 74;
+        return result;
+    }
+    std::unique_ptr<Vm> vm(new Vm());
+    configure(*vm, options);
+    vm->setDisassemble(false);
+    vm->setThreads(1); // the files of the batch have the threads already
+    vm->setOutput(out, errors);
+    result.status = execute(*vm, path, errors);
+    vm.reset();
+    result.out = takeText(out, outText, outSize);
+    result.errors = takeText(errors, errorText, errorSize);
+    return result;
+}
+
+// Runs the files on `jobs` threads and prints their output in the order of the files.
+// The exit status is that of the first file that failed.
+static int runBatch(const std::vector<const char*>& paths, const Options& options, size_t jobs){
+    std::vector<std::future<BatchResult>> results;
+    int status = 0;
+    {
+        ThreadPool pool(jobs);
+        for(const char* path : paths){
+            auto task = std::make_shared<std::packaged_task<BatchResult()>>([path, &options]{
+                return runBatchFile(path, options);
+            });
+            results.push_back(task->get_future());
+            pool.submit([task]{ (*task)(); });
+        }
+        for(auto& future : results){
+            BatchResult result = future.get();
+            fwrite(result.out.data(), 1, result.out.size(), stdout);
+            fflush(stdout);
+            fwrite(result.errors.data(), 1, result.errors.size(), stderr);
+            if(status == 0) status = result.status;
+        }
     }
+    return status;
+}
 
+static void usage(){
+    fprintf(stderr, "Usage: AddressProgrammingLanguage [-O] [--registers] [--cache-dir dir] [--threads n]\n"
+                    "                                  [--profile [--profile-json file]] [path | path.apc | -]\n"
+                    "       AddressProgrammingLanguage [-O] [--registers] [--cache-dir dir] --jobs n path...\n"
+                    "       AddressProgrammingLanguage [-O] --compile-only -o path.apc path\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[]) {
-    vm.initVM();
-//    if(argc == 1) repl();
-//    else if(argc == 2) runFile(argv[1]);
-    runFile("..\\unitTests\\test7.txt");
+    Options options;
+    int arg = 1;
+    bool compileOnly = false;
+    bool batch = false;
+    size_t jobs = 0;
+    const char* output = nullptr;
+    for(; arg < argc && argv[arg][0] == '-'; arg++) {
+        if(strcmp(argv[arg], "-O") == 0) options.optimize = true;
+        else if(strcmp(argv[arg], "--registers") == 0) options.backend = Backend::REGISTER;
+        else if(strcmp(argv[arg], "--compile-only") == 0) compileOnly = true;
+        else if(strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) output = argv[++arg];
+        else if(strcmp(argv[arg], "--cache-dir") == 0 && arg + 1 < argc) options.cacheDirectory = argv[++arg];
+        else if(strcmp(argv[arg], "--profile") == 0) profileJson = profileJson ? profileJson : "profile.json";
+        else if(strcmp(argv[arg], "--profile-json") == 0 && arg + 1 < argc) profileJson = argv[++arg];
+        else if(strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc)
+            options.threads = strtoul(argv[++arg], nullptr, 10); // 1 runs every loop serially
+        else if(strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+            batch = true;
+            jobs = strtoul(argv[++arg], nullptr, 10); // 0 is one per hardware thread
+        }
+        else break;
+    }
+    if(compileOnly != (output != nullptr)) usage();
+    if(batch) {
+        // one profiler can't count several threads
+        if(compileOnly || profileJson || arg == argc) usage();
+        return runBatch(std::vector<const char*>(argv + arg, argv + argc), options, jobs);
+    }
+
+    Vm vm;
+    configure(vm, options);
+    if(profileJson && !compileOnly) atexit(reportProfile);
+    if(compileOnly) {
+        if(arg != argc - 1) usage();
+        compileFile(vm, argv[arg], output);
+    }
+    else if(arg == argc) repl(vm);
+    else if(arg == argc - 1 && strcmp(argv[arg], "-") == 0) runStream(vm);
+    else if(arg == argc - 1) runFile(vm, argv[arg]);
+    else usage();
     vm.freeVM();
 
     return 0;
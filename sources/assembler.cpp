@@ -0,0 +1,134 @@
+#include <cassert>
+#include "../headers/assembler.h"
+
+static bool isGenericJump(byte op){
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE;
+}
+
+Assembly::Assembly(const Chunk& chunk) {
+    std::vector<size_t> index(chunk.code.size() + 1, SIZE_MAX); // byte offset -> instruction
+    for(size_t i = 0; i < chunk.code.size(); i += chunk.instructionLength(i)){
+        index[i] = instructions.size();
+        Instruction instruction{chunk.code[i], 0, chunk.lines[i]};
+        switch (chunk.code[i]) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+                instruction.op = OP_CONSTANT;
+                instruction.operand = chunk.constantIndex(i);
+                break;
+            case OP_GET_SLOT:
+            case OP_SET_SLOT:
+            case OP_LOOP_PREPARE:
+            case OP_LOOP_STEP:
+                instruction.operand = chunk.code[i + 1] << 8 | chunk.code[i + 2];
+                break;
+            case OP_JUMP: case OP_JUMP_WIDE: case OP_JUMP_LONG:
+                instruction.op = OP_JUMP;
+                instruction.operand = chunk.jumpTarget(i); // byte offset until all indices are known
+                break;
+            case OP_JUMP_IF_FALSE: case OP_JUMP_IF_FALSE_WIDE: case OP_JUMP_IF_FALSE_LONG:
+                instruction.op = OP_JUMP_IF_FALSE;
+                instruction.operand = chunk.jumpTarget(i);
+                break;
+            default:
+                break;
+        }
+        instructions.push_back(instruction);
+    }
+    index[chunk.code.size()] = instructions.size();
+
+    for(auto& instruction : instructions){
+        if(!isGenericJump(instruction.op)) continue;
+        assert(index[instruction.operand] != SIZE_MAX); // jumps land on instruction boundaries
+        instruction.operand = index[instruction.operand];
+    }
+    for(auto& label : chunk.labelMap){
+        assert(index[label.second] != SIZE_MAX);
+        labels.emplace_back(label.first, index[label.second]);
+    }
+}
+
+void Assembly::remove(const std::vector<bool>& removed) {
+    std::vector<size_t> newIndex(instructions.size() + 1);
+    size_t kept = 0;
+    for(size_t i = 0; i < instructions.size(); i++){
+        newIndex[i] = kept;
+        if(!removed[i]) instructions[kept++] = instructions[i];
+    }
+    newIndex[instructions.size()] = kept;
+    instructions.resize(kept);
+
+    for(auto& instruction : instructions)
+        if(isGenericJump(instruction.op)) instruction.operand = newIndex[instruction.operand];
+    for(auto& label : labels) label.second = newIndex[label.second];
+}
+
+static size_t encodedLength(const Instruction& instruction, int jumpWidth){
+    switch (instruction.op) {
+        case OP_CONSTANT: return instruction.operand <= UINT8_MAX ? 2 : 4;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE: return 1 + jumpWidth;
+        case OP_GET_SLOT:
+        case OP_SET_SLOT:
+        case OP_LOOP_PREPARE:
+        case OP_LOOP_STEP: return 3;
+        default: return 1;
+    }
+}
+
+void Assembly::assemble(Chunk& chunk) const {
+    // Every jump starts with a 1 byte distance and grows until its distance fits.
+    // Lengths only grow, so this settles after a few rounds.
+    std::vector<int> jumpWidth(instructions.size(), 1);
+    std::vector<size_t> offsets(instructions.size() + 1);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        offsets[0] = 0;
+        for(size_t i = 0; i < instructions.size(); i++)
+            offsets[i + 1] = offsets[i] + encodedLength(instructions[i], jumpWidth[i]);
+        for(size_t i = 0; i < instructions.size(); i++){
+            if(!isGenericJump(instructions[i].op)) continue;
+            int64_t distance = (int64_t)offsets[instructions[i].operand] - (int64_t)offsets[i + 1];
+            int width = distance >= 0 && distance <= UINT8_MAX ? 1 :
+                        distance >= INT16_MIN && distance <= INT16_MAX ? 2 : 4;
+            if(width > jumpWidth[i]) {
+                jumpWidth[i] = width;
+                changed = true;
+            }
+        }
+    }
+
+    chunk.code.clear();
+    chunk.lines.clear();
+    for(size_t i = 0; i < instructions.size(); i++){
+        const Instruction& instruction = instructions[i];
+        switch (instruction.op) {
+            case OP_CONSTANT:
+                chunk.writeConstantIndex(instruction.operand, instruction.line);
+                break;
+            case OP_GET_SLOT:
+            case OP_SET_SLOT:
+            case OP_LOOP_PREPARE:
+            case OP_LOOP_STEP:
+                chunk.write(instruction.op, instruction.line);
+                chunk.write((instruction.operand >> 8) & 0xff, instruction.line);
+                chunk.write(instruction.operand & 0xff, instruction.line);
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE: {
+                bool conditional = instruction.op == OP_JUMP_IF_FALSE;
+                byte op = jumpWidth[i] == 1 ? instruction.op :
+                          jumpWidth[i] == 2 ? (byte)(conditional ? OP_JUMP_IF_FALSE_WIDE : OP_JUMP_WIDE) :
+                                              (byte)(conditional ? OP_JUMP_IF_FALSE_LONG : OP_JUMP_LONG);
+                chunk.write(op, instruction.line);
+                for(int j = 0; j < jumpWidth[i]; j++) chunk.write(0, instruction.line);
+                chunk.setJumpTarget(offsets[i], offsets[instruction.operand]);
+                break;
+            }
+            default:
+                chunk.write(instruction.op, instruction.line);
+        }
+    }
+    for(auto& label : labels) chunk.labelMap[label.first] = offsets[label.second];
+}
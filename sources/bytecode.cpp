@@ -0,0 +1,237 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "../headers/bytecode.h"
+#include "../headers/mappedfile.h"
+
+static const char MAGIC[4] = {'A', 'P', 'C', '\0'};
+
+static void report(bool quiet, const char* format, ...){
+    if(quiet) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static void put32(std::string& out, uint32_t value){
+    for(int i = 0; i < 4; i++) out.push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static void putNumber(std::string& out, double number){
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    put32(out, bits & 0xffffffff);
+    put32(out, bits >> 32);
+}
+
+static void putString(std::string& out, const std::string& s){
+    put32(out, s.size());
+    out += s;
+}
+
+static bool putConstant(std::string& out, const Value& value){
+    out.push_back((char)value.type());
+    if(value.type() == ValueType::NUMBER) putNumber(out, value.number());
+    else if(value.type() == ValueType::STRING) put32(out, StringPool::idOf(value.string()));
+    else return false; // pointers only exist at runtime
+    return true;
+}
+
+bool writeBytecode(const Chunk& chunk, const char* path, bool quiet){
+    std::vector<LineRun> runs = chunk.isFinal() ? chunk.lineRuns : Chunk::runsOf(chunk.lines);
+
+    std::string out(MAGIC, sizeof(MAGIC));
+    put32(out, BYTECODE_VERSION);
+    for(size_t count : {chunk.code.size(), runs.size(), chunk.strings.size(), chunk.strings.slotCount(),
+                        chunk.constants.size(), chunk.labelMap.size(), chunk.loops.size()})
+        put32(out, count);
+    out.append((const char*)chunk.code.data(), chunk.code.size());
+    for(auto& run : runs){
+        put32(out, run.line);
+        put32(out, run.count);
+    }
+    for(size_t i = 0; i < chunk.strings.size(); i++) putString(out, chunk.strings.at(i));
+    for(size_t i = 0; i < chunk.strings.slotCount(); i++) put32(out, StringPool::idOf(chunk.strings.atSlot(i)));
+    for(auto& constant : chunk.constants)
+        if(!putConstant(out, constant)) {
+            report(quiet, "Can't store constant %s.\n", std::string(constant).c_str());
+            return false;
+        }
+    for(auto& label : chunk.labelMap){
+        putString(out, label.first);
+        put32(out, label.second);
+    }
+    for(auto& loop : chunk.loops){
+        put32(out, loop.parts.size());
+        for(auto& part : loop.parts){
+            if(!putConstant(out, part.parameter)) return false;
+            put32(out, part.sequences.size());
+            for(auto& sequence : part.sequences){
+                putNumber(out, sequence.init);
+                putNumber(out, sequence.step);
+                putNumber(out, sequence.end);
+            }
+        }
+    }
+
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        report(quiet, "Can't write \"%s\".\n", path);
+        return false;
+    }
+    bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    written = fclose(file) == 0 && written;
+    if(!written) report(quiet, "Can't write \"%s\".\n", path);
+    return written;
+}
+
+namespace {
+
+// Bounds-checked cursor over the mapped file, `ok` turns false on the first read past its end
+struct Reader {
+    const byte* at;
+    const byte* end;
+    bool ok{true};
+
+    bool has(size_t bytes){
+        if(ok && (size_t)(end - at) < bytes) ok = false;
+        return ok;
+    }
+    uint32_t u32(){
+        if(!has(4)) return 0;
+        uint32_t value = at[0] | at[1] << 8 | at[2] << 16 | (uint32_t)at[3] << 24;
+        at += 4;
+        return value;
+    }
+    double number(){
+        uint64_t bits = u32();
+        bits |= (uint64_t)u32() << 32;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    const char* bytes(size_t length){
+        if(!has(length)) return nullptr;
+        const char* start = (const char*)at;
+        at += length;
+        return start;
+    }
+    bool constant(const Chunk& chunk, Value& value){
+        const char* type = bytes(1);
+        if(!type) return false;
+        if((ValueType)*type == ValueType::NUMBER) value = Value(number());
+        else if((ValueType)*type == ValueType::STRING) {
+            uint32_t id = u32();
+            if(id >= chunk.strings.size()) return ok = false;
+            value = Value(chunk.strings.at(id));
+        } else return ok = false;
+        return ok;
+    }
+};
+
+}
+
+// Every instruction lies inside the code and only refers to things the file defines,
+// so a damaged file can't send Vm::run outside of the chunk.
+static bool verify(const Chunk& chunk){
+    if(chunk.code.empty() || chunk.code.back() != OP_RETURN) return false;
+    std::vector<bool> boundary(chunk.code.size() + 1, false);
+    for(size_t i = 0; i < chunk.code.size(); i += chunk.instructionLength(i)){
+        byte op = chunk.code[i];
+        if(op > OP_LOOP_STEP || i + chunk.instructionLength(i) > chunk.code.size()) return false;
+        boundary[i] = true;
+        uint32_t operand = chunk.instructionLength(i) == 3 ? chunk.code[i + 1] << 8 | chunk.code[i + 2] : 0;
+        if((op == OP_CONSTANT || op == OP_CONSTANT_LONG) && chunk.constantIndex(i) >= chunk.constants.size())
+            return false;
+        if((op == OP_GET_SLOT || op == OP_SET_SLOT) && operand >= chunk.strings.slotCount()) return false;
+        if((op == OP_LOOP_PREPARE || op == OP_LOOP_STEP) && operand >= chunk.loops.size()) return false;
+    }
+    for(size_t i = 0; i < chunk.code.size(); i += chunk.instructionLength(i))
+        if(Chunk::isJump(chunk.code[i]) && (chunk.jumpTarget(i) >= chunk.code.size() || !boundary[chunk.jumpTarget(i)]))
+            return false;
+    for(auto& label : chunk.labelMap)
+        if(!boundary[label.second]) return false;
+    return true;
+}
+
+bool readBytecode(const char* path, Chunk& chunk, bool quiet){
+    MappedFile file(path);
+    if(!file.isOpen()) {
+        report(quiet, "Can't open \"%s\".\n", path);
+        return false;
+    }
+    Reader in{(const byte*)file.data(), (const byte*)file.data() + file.size()};
+    const char* magic = in.bytes(sizeof(MAGIC));
+    if(!magic || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+        report(quiet, "\"%s\" is not compiled bytecode.\n", path);
+        return false;
+    }
+    uint32_t version = in.u32();
+    if(version != BYTECODE_VERSION) {
+        report(quiet, "\"%s\" was compiled for bytecode version %u, this is version %u. Compile it again.\n",
+                path, version, BYTECODE_VERSION);
+        return false;
+    }
+    uint32_t codeSize = in.u32(), runs = in.u32(), strings = in.u32(), slots = in.u32(), constants = in.u32(),
+             labels = in.u32(), loops = in.u32();
+
+    const char* code = in.bytes(codeSize);
+    if(code) chunk.code.assign(code, code + codeSize);
+    std::vector<LineRun> lineRuns;
+    uint32_t covered = 0;
+    for(uint32_t i = 0; i < runs && in.ok; i++){
+        int line = in.u32();
+        uint32_t bytes = in.u32();
+        if(bytes > codeSize - covered) in.ok = false;
+        covered += bytes;
+        lineRuns.push_back({bytes, line});
+    }
+    if(covered != codeSize) in.ok = false;
+    for(uint32_t i = 0; i < strings && in.ok; i++){
+        uint32_t length = in.u32();
+        const char* s = in.bytes(length);
+        if(s && StringPool::idOf(chunk.strings.intern(s, length)) != i) in.ok = false; // names are unique
+    }
+    for(uint32_t i = 0; i < slots && in.ok; i++){
+        uint32_t id = in.u32();
+        if(id >= chunk.strings.size() || chunk.strings.addSlot(chunk.strings.at(id)) != i) in.ok = false;
+    }
+    for(uint32_t i = 0; i < constants && in.ok; i++){
+        Value constant;
+        if(in.constant(chunk, constant) && (uint32_t)chunk.addConstant(constant) != i) in.ok = false;
+    }
+    for(uint32_t i = 0; i < labels && in.ok; i++){
+        uint32_t length = in.u32();
+        const char* name = in.bytes(length);
+        uint32_t offset = in.u32();
+        if(in.ok) chunk.labelMap[std::string(name, length)] = offset;
+    }
+    for(uint32_t i = 0; i < loops && in.ok; i++){
+        LoopDescriptor loop;
+        uint32_t parts = in.u32();
+        for(uint32_t p = 0; p < parts && in.ok; p++){
+            LoopPart part;
+            if(!in.constant(chunk, part.parameter)) break;
+            uint32_t sequences = in.u32();
+            if(sequences == 0) in.ok = false; // a part starts at its first sequence
+            for(uint32_t j = 0; j < sequences && in.ok; j++){
+                LoopSequence sequence{};
+                sequence.init = in.number();
+                sequence.step = in.number();
+                sequence.end = in.number();
+                part.sequences.push_back(sequence);
+            }
+            loop.parts.push_back(part);
+        }
+        chunk.loops.push_back(loop);
+    }
+    if(!in.ok || in.at != in.end || !verify(chunk)) {
+        report(quiet, "\"%s\" is damaged.\n", path);
+        return false;
+    }
+    chunk.finalize();
+    chunk.setLineRuns(std::move(lineRuns)); // the file has no per-byte lines to build them from
+    return true;
+}
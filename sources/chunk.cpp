@@ -1,82 +1,392 @@
 #include <cstdio>
+#include <algorithm>
 #include <cassert>
-#include <iostream>
 #include "../headers/chunk.h"
+#include "../headers/assembler.h"
 
 void Chunk::write(byte val, int line) {
+    assert(!final);
     lines.push_back(line);
     code.push_back(val);
 }
+std::vector<LineRun> Chunk::runsOf(const std::vector<int>& lines) {
+    std::vector<LineRun> runs;
+    for(int line : lines){
+        if(runs.empty() || runs.back().line != line) runs.push_back({0, line});
+        runs.back().count++;
+    }
+    return runs;
+}
+
+const uint32_t Chunk::UNBOUNDED_STACK;
+
+// Values an instruction takes off the stack and puts back, in that order
+static void stackEffect(byte op, int& pops, int& pushes) {
+    pops = 0;
+    pushes = 0;
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_SLOT:
+        case OP_LOOP_PREPARE:
+        case OP_LOOP_STEP:
+            pushes = 1; break;
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_GET_POINTER:
+        case OP_GET_LABEL:
+            pops = 1; pushes = 1; break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_SET_POINTER:
+        case OP_SET_POINTER_INVERSE:
+        case OP_EXCHANGE:
+            pops = 2; pushes = 1; break;
+        case OP_PRINT:
+        case OP_POP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_WIDE:
+        case OP_JUMP_IF_FALSE_LONG:
+            pops = 1; break;
+        case OP_SET_POINTER_WITHOUT_PUSH:
+        case OP_JUMP_IF_FALSE_TO_LABEL:
+            pops = 2; break;
+        default: break; // OP_SET_SLOT only looks at the top
+    }
+}
+
+// The most values the code pushes above the depth it is entered at, from the start or from a label.
+// A jump to a label computed at runtime keeps the values below it, so Vm checks room for this many
+// more at every such jump. Depths that differ where paths meet are met with the larger one,
+// unless the larger one comes around a loop: then each pass could push more, and there is no bound.
+static uint32_t maxStackOf(const Chunk& chunk) {
+    const long UNVISITED = -1;
+    std::vector<long> depth(chunk.count() + 1, UNVISITED);
+    std::vector<size_t> work;
+    long deepest = 0;
+    auto reach = [&](size_t from, size_t at, long d) {
+        if(at > chunk.count()) return true;
+        if(depth[at] >= d) return true;
+        if(depth[at] != UNVISITED && at <= from) return false;
+        depth[at] = d;
+        work.push_back(at);
+        return true;
+    };
+    for(size_t entry : chunk.entryPoints) reach(0, entry, 0);
+    while(!work.empty()) {
+        size_t i = work.back();
+        work.pop_back();
+        if(i >= chunk.count()) continue;
+        byte op = chunk.code[i];
+        int pops, pushes;
+        stackEffect(op, pops, pushes);
+        long d = std::max(depth[i] - pops, 0L) + pushes;
+        deepest = std::max(deepest, d);
+        if(op == OP_RETURN || op == OP_PART_END) continue;
+        if(Chunk::isJump(op) && !reach(i, chunk.jumpTarget(i), d)) return Chunk::UNBOUNDED_STACK;
+        bool jumpsAlways = op == OP_JUMP || op == OP_JUMP_WIDE || op == OP_JUMP_LONG;
+        if(!jumpsAlways && !reach(i, i + chunk.instructionLength(i), d)) return Chunk::UNBOUNDED_STACK;
+    }
+    return deepest;
+}
+
+void Chunk::finalize() {
+    if(final) return;
+    entryPoints.assign(1, 0);
+    for(auto& label : labelMap) entryPoints.push_back(label.second);
+    std::sort(entryPoints.begin(), entryPoints.end());
+    entryPoints.erase(std::unique(entryPoints.begin(), entryPoints.end()), entryPoints.end());
+    maxStack = maxStackOf(*this);
+    setLineRuns(runsOf(lines));
+    std::vector<int>().swap(lines);
+    code.shrink_to_fit();
+    constants.shrink_to_fit();
+    std::unordered_map<uint64_t, int>().swap(numberConstants);
+    std::unordered_map<const char*, int>().swap(stringConstants);
+    final = true;
+}
+
+// Only code entered from here has its stack depth bounded by maxStack
+bool Chunk::isEntryPoint(size_t offset) const {
+    return std::binary_search(entryPoints.begin(), entryPoints.end(), offset);
+}
+
+int Chunk::lineAt(size_t offset) const {
+    if(!final) return lines[offset];
+    auto end = std::upper_bound(lineRunEnds.begin(), lineRunEnds.end(), offset);
+    return end == lineRunEnds.end() ? -1 : lineRuns[end - lineRunEnds.begin()].line;
+}
+
+void Chunk::setLineRuns(std::vector<LineRun> runs) {
+    lineRuns = std::move(runs);
+    lineRunEnds.clear();
+    lineRunEnds.reserve(lineRuns.size());
+    size_t end = 0;
+    for(const LineRun& run : lineRuns) lineRunEnds.push_back(end += run.count);
+}
+
+// Appends another chunk. Its constants, names and loops are re-added to this chunk's pools,
+// which can change the width of a constant instruction, so relative jumps are re-targeted.
 void Chunk::write(Chunk& chunk) {
-    for(int i=0; i< chunk.count(); i++) {
-        lines.push_back(chunk.lines[i]);
-        code.push_back(chunk.code[i]);
-        if(chunk.code[i] == OP_CONSTANT)
+    assert(!chunk.final);
+    std::vector<size_t> offsets(chunk.count() + 1);
+    std::vector<size_t> jumps;
+    std::vector<size_t> loopBase; // index in `loops` of each loop of the appended chunk
+    for(size_t i=0; i< chunk.count(); i += chunk.instructionLength(i)) {
+        offsets[i] = count();
+        byte op = chunk.code[i];
+        if(op == OP_CONSTANT || op == OP_CONSTANT_LONG)
+        {
+            Value constant = chunk.constants[chunk.constantIndex(i)];
+            if(constant.type() == ValueType::STRING) {
+                const char* name = strings.intern(constant.string());
+                if(StringPool::slotOf(constant.string()) != StringPool::NO_SLOT) strings.addSlot(name);
+                constant = Value(name);
+            }
+            writeConstant(constant, chunk.lines[i]);
+            continue;
+        }
+        if(op == OP_GET_SLOT || op == OP_SET_SLOT)
         {
-            i++;
-            constants.push_back(chunk.constants[chunk.code[i]]);
-            code.push_back(constants.size() - 1);
+            const char* name = chunk.strings.atSlot(chunk.code[i + 1] << 8 | chunk.code[i + 2]);
+            writeSlot(op, strings.intern(name), chunk.lines[i]);
+            continue;
         }
+        if(op == OP_LOOP_PREPARE || op == OP_LOOP_STEP)
+        {
+            uint32_t loop = chunk.code[i + 1] << 8 | chunk.code[i + 2];
+            if(loop >= loopBase.size()) loopBase.resize(loop + 1, SIZE_MAX);
+            if(loopBase[loop] == SIZE_MAX) {
+                loopBase[loop] = loops.size();
+                loops.push_back(chunk.loops[loop]);
+                for(auto& part : loops.back().parts)
+                    if(part.parameter.type() == ValueType::STRING) {
+                        part.parameter = Value(strings.intern(part.parameter.string()));
+                        strings.addSlot(part.parameter.string());
+                    }
+            }
+            assert(loopBase[loop] <= UINT16_MAX);
+            write(op, chunk.lines[i]);
+            write((loopBase[loop] >> 8) & 0xff, chunk.lines[i]);
+            write(loopBase[loop] & 0xff, chunk.lines[i]);
+            continue;
+        }
+        if(isJump(op)) jumps.push_back(i);
+        for(size_t j = 0; j < chunk.instructionLength(i); j++)
+            write(chunk.code[i + j], chunk.lines[i + j]);
+    }
+    offsets[chunk.count()] = count();
+
+    for(size_t jump : jumps)
+        setJumpTarget(offsets[jump], offsets[chunk.jumpTarget(jump)]);
+}
+
+void Chunk::writeConstant(Value value, int line) {
+    int index = addConstant(value);
+    writeConstantIndex(index, line);
+    lastConstant = index;
+}
+
+void Chunk::writeConstantIndex(uint32_t index, int line) {
+    if(index <= UINT8_MAX){
+        write(OP_CONSTANT, line);
+        write(index, line);
+    } else {
+        assert(index < (1 << 24));
+        write(OP_CONSTANT_LONG, line);
+        write((index >> 16) & 0xff, line);
+        write((index >> 8) & 0xff, line);
+        write(index & 0xff, line);
     }
 }
 
+// OP_GET_SLOT or OP_SET_SLOT of an interned name, which gets a slot. Slot operands have 16 bits, a name
+// with a larger slot is pushed and goes through OP_GET_POINTER, or OP_SET_POINTER_INVERSE, which leaves
+// the assigned value on the stack like OP_SET_SLOT. The name is not the constant of a statement for compileUntil.
+void Chunk::writeSlot(byte op, const char* name, int line) {
+    uint32_t slot = strings.addSlot(name);
+    if(slot <= UINT16_MAX){
+        write(op, line);
+        write((slot >> 8) & 0xff, line);
+        write(slot & 0xff, line);
+        return;
+    }
+    int last = lastConstant;
+    writeConstant(Value(name), line);
+    lastConstant = last;
+    write(op == OP_GET_SLOT ? OP_GET_POINTER : OP_SET_POINTER_INVERSE, line);
+}
+
+// Numbers and strings are stored once per chunk
 int Chunk::addConstant(Value const_val) {
+    if(const_val.type() == ValueType::NUMBER){
+        uint64_t bits;
+        double number = const_val.number();
+        memcpy(&bits, &number, sizeof(bits));
+        auto found = numberConstants.find(bits);
+        if(found != numberConstants.end()) return found->second;
+        constants.push_back(const_val);
+        return numberConstants[bits] = constants.size() - 1;
+    }
+    if(const_val.type() == ValueType::STRING){
+        auto found = stringConstants.find(const_val.string());
+        if(found != stringConstants.end()) return found->second;
+        constants.push_back(const_val);
+        return stringConstants[const_val.string()] = constants.size() - 1;
+    }
     constants.push_back(const_val);
     return constants.size() - 1;
 }
 
-void Value::printValue() const{
-    std::cout << std::string(*this);
+uint32_t Chunk::constantIndex(size_t offset) const {
+    if(code[offset] == OP_CONSTANT) return code[offset + 1];
+    return code[offset + 1] << 16 | code[offset + 2] << 8 | code[offset + 3];
 }
- Value::operator std::string() const{
-    switch (type) {
-        case ValueType::NUMBER:
-            return std::to_string(val.number);
-        case ValueType::BOXED:
-            return std::string(*val.pointTo);
-        case ValueType::STRING:
-            return val.string;
-        case ValueType::BOOL:
-            return  (val.boolean ? "true" : "false");
-        case ValueType::POINTER:
-            return ("Pointer to :\t") + std::string(*val.pointTo);
+
+size_t Chunk::instructionLength(size_t offset) const {
+    switch (code[offset]) {
+        case OP_CONSTANT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            return 2;
+        case OP_JUMP_WIDE:
+        case OP_JUMP_IF_FALSE_WIDE:
+        case OP_GET_SLOT:
+        case OP_SET_SLOT:
+        case OP_LOOP_PREPARE:
+        case OP_LOOP_STEP:
+            return 3;
+        case OP_CONSTANT_LONG:
+            return 4;
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+            return 5;
+        default:
+            return 1;
     }
-     return "";
 }
 
-bool Value::operator==(const Value &other) const {
-    if(type !=  other.type) return false;
-    switch (type) {
-        case ValueType::BOXED: return val.pointTo == other.val.pointTo;
-        case ValueType::POINTER: return val.pointTo == other.val.pointTo;
-        case ValueType::NUMBER: return val.number == other.val.number;
+bool Chunk::isJump(byte op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_WIDE:
+        case OP_JUMP_IF_FALSE_WIDE:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Jump distances count from the end of the jump instruction
+size_t Chunk::jumpTarget(size_t offset) const {
+    size_t end = offset + instructionLength(offset);
+    switch (code[offset]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            return end + code[offset + 1];
+        case OP_JUMP_WIDE:
+        case OP_JUMP_IF_FALSE_WIDE:
+            return end + (int16_t)(code[offset + 1] << 8 | code[offset + 2]);
+        default:
+            return end + (int32_t)((uint32_t)code[offset + 1] << 24 | code[offset + 2] << 16 |
+                                   code[offset + 3] << 8 | code[offset + 4]);
     }
-    return false;
 }
 
-std::vector<const char*> strings;
-const char* addString(const char* start, int length){
-    char* newStr = new char[length + 1];
-    strncpy(newStr, start, length);
-    newStr[length] = '\0';
-    strings.push_back(newStr);
-    return newStr;
+void Chunk::setJumpTarget(size_t offset, size_t target) {
+    int64_t distance = (int64_t)target - (int64_t)(offset + instructionLength(offset));
+    switch (code[offset]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            assert(distance >= 0 && distance <= UINT8_MAX);
+            code[offset + 1] = distance;
+            break;
+        case OP_JUMP_WIDE:
+        case OP_JUMP_IF_FALSE_WIDE:
+            assert(distance >= INT16_MIN && distance <= INT16_MAX);
+            code[offset + 1] = (distance >> 8) & 0xff;
+            code[offset + 2] = distance & 0xff;
+            break;
+        default:
+            assert(distance >= INT32_MIN && distance <= INT32_MAX);
+            for(int i = 1; i <= 4; i++) code[offset + i] = (distance >> (32 - 8 * i)) & 0xff;
+    }
 }
 
-const char* addString(const char* start){
-    return addString(start, strlen(start));
+// Replaces `OP_CONSTANT label, OP_POP` and `OP_CONSTANT label, OP_JUMP_IF_FALSE_TO_LABEL`
+// with relative jumps when the label is declared in this chunk, then re-assembles the chunk
+// so every jump gets its shortest encoding.
+// Labels computed at runtime (pointer cells) keep the dynamic lookup in Vm::run.
+void Chunk::resolveLabels() {
+    Assembly assembly(*this);
+    std::vector<Instruction>& ins = assembly.instructions;
+
+    std::vector<bool> isTarget(ins.size() + 1, false);
+    for(auto& instruction : ins)
+        if(instruction.op == OP_JUMP || instruction.op == OP_JUMP_IF_FALSE) isTarget[instruction.operand] = true;
+    std::map<std::string, size_t> labelIndex;
+    for(auto& label : assembly.labels) {
+        isTarget[label.second] = true;
+        labelIndex[label.first] = label.second;
+    }
+
+    std::vector<bool> removed(ins.size(), false);
+    for(size_t i = 0; i + 1 < ins.size(); i++){
+        byte next = ins[i + 1].op;
+        if(ins[i].op != OP_CONSTANT || isTarget[i + 1]) continue;
+        if(next != OP_POP && next != OP_JUMP_IF_FALSE_TO_LABEL) continue;
+
+        const Value& label = constants[ins[i].operand];
+        if(label.type() != ValueType::STRING) continue;
+        auto target = labelIndex.find(label.string());
+        if(target == labelIndex.end()) continue;
+
+        ins[i].op = next == OP_POP ? OP_JUMP : OP_JUMP_IF_FALSE;
+        ins[i].operand = target->second;
+        removed[++i] = true;
+    }
+    assembly.remove(removed);
+    assembly.assemble(*this);
 }
 
-#define DOUBLE_MAX_LEN  30
-const char* addNumString(double value){
-    char* newStr = new char[DOUBLE_MAX_LEN];
-    sprintf(newStr, "%g", value);
-    strings.push_back(newStr);
-    return newStr;
+void Value::printValue(FILE* out) const{
+    fputs(std::string(*this).c_str(), out);
+}
+ Value::operator std::string() const{
+    switch (type()) {
+        case ValueType::NUMBER:
+            return std::to_string(number());
+        case ValueType::BOXED:
+            return std::string(*pointTo());
+        case ValueType::STRING:
+            return string();
+        case ValueType::BOOL:
+            return  (boolean() ? "true" : "false");
+        case ValueType::POINTER:
+            return ("Pointer to :\t") + std::string(*pointTo());
+    }
+     return "";
 }
 
-void freeStrings(){
-    for( auto strIt = strings.begin(); strIt !=strings.end(); strIt++){
-        delete[] *strIt;
+bool Value::operator==(const Value &other) const {
+    if(type() !=  other.type()) return false;
+    switch (type()) {
+        case ValueType::BOXED: return pointTo() == other.pointTo();
+        case ValueType::POINTER: return pointTo() == other.pointTo();
+        case ValueType::NUMBER: return number() == other.number();
     }
+    return false;
 }
@@ -0,0 +1,137 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "../headers/compilecache.h"
+#include "../headers/bytecode.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#else
+static int getpid(){ return 0; }
+#endif
+
+const size_t CompileCache::DEFAULT_ENTRIES;
+const size_t CompileCache::DEFAULT_BYTES;
+
+// murmur3's finalizer, every input bit reaches every output bit
+static inline uint64_t mix(uint64_t h){
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Two independent 64-bit hashes over 8 bytes at a time, collisions of both are not worth checking for
+CompileCache::Key CompileCache::keyOf(const char* source, size_t length, uint32_t options){
+    uint64_t low = 0x9e3779b97f4a7c15ULL ^ length ^ (uint64_t)options << 32, high = 0x6a09e667f3bcc909ULL ^ options;
+    size_t i = 0;
+    for(; i + 8 <= length; i += 8){
+        uint64_t word;
+        memcpy(&word, source + i, sizeof(word));
+        low = (low ^ mix(word)) * 0x100000001b3ULL;
+        high = (high ^ mix(word ^ 0x2545f4914f6cdd1dULL)) * 0xff51afd7ed558ccdULL;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, source + i, length - i);
+    low = mix(low ^ mix(tail));
+    high = mix(high ^ mix(tail ^ 0x2545f4914f6cdd1dULL) ^ length);
+    return {low, high};
+}
+
+// What a chunk holds on the heap, roughly
+static size_t bytesOf(const Chunk& chunk){
+    size_t bytes = sizeof(Chunk) + chunk.code.capacity() + chunk.lines.capacity() * sizeof(int) +
+                   chunk.lineRuns.capacity() * sizeof(LineRun) + chunk.lineRunEnds.capacity() * sizeof(size_t) +
+                   chunk.constants.capacity() * sizeof(Value);
+    for(size_t i = 0; i < chunk.strings.size(); i++) bytes += strlen(chunk.strings.at(i)) + 1 + 2 * sizeof(void*);
+    for(auto& label : chunk.labelMap) bytes += label.first.capacity() + 48;
+    for(auto& loop : chunk.loops)
+        for(auto& part : loop.parts) bytes += sizeof(LoopPart) + part.sequences.capacity() * sizeof(LoopSequence);
+    bytes += (chunk.numberConstants.size() + chunk.stringConstants.size()) * 32;
+    return bytes;
+}
+
+std::shared_ptr<Chunk> CompileCache::find(const Key& key){
+    auto found = index.find(key);
+    if(found != index.end()) {
+        entries.splice(entries.begin(), entries, found->second);
+        counters.hits++;
+        return found->second->chunk;
+    }
+    if(!directory.empty()) {
+        std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+        // a missing file, one of another version or a damaged one is compiled again and replaced
+        if(readBytecode(pathOf(key).c_str(), *chunk, true)) {
+            counters.diskHits++;
+            remember(key, chunk);
+            return chunk;
+        }
+    }
+    counters.misses++;
+    return nullptr;
+}
+
+void CompileCache::insert(const Key& key, const std::shared_ptr<Chunk>& chunk){
+    remember(key, chunk);
+    if(directory.empty()) return;
+    // written aside and renamed, so another process never reads half a file
+    std::string path = pathOf(key);
+    static std::atomic<unsigned> writes{0}; // caches of several threads can write the same file
+    std::string temporary = path + "." + std::to_string(getpid()) + "." + std::to_string(writes++);
+    if(writeBytecode(*chunk, temporary.c_str(), true) && rename(temporary.c_str(), path.c_str()) == 0) return;
+    remove(temporary.c_str());
+}
+
+void CompileCache::remember(const Key& key, const std::shared_ptr<Chunk>& chunk){
+    auto found = index.find(key);
+    if(found != index.end()) {
+        counters.bytes -= found->second->bytes;
+        entries.erase(found->second);
+        index.erase(found);
+    }
+    entries.push_front({key, chunk, bytesOf(*chunk)});
+    index[key] = entries.begin();
+    counters.bytes += entries.front().bytes;
+    trim();
+}
+
+// Dropping a chunk that is running is fine, Vm::interpret holds on to it
+void CompileCache::trim(){
+    while(!entries.empty() && (entries.size() > maxEntries || counters.bytes > maxBytes)) {
+        counters.bytes -= entries.back().bytes;
+        index.erase(entries.back().key);
+        entries.pop_back();
+        counters.evictions++;
+    }
+}
+
+std::string CompileCache::pathOf(const Key& key) const {
+    char name[40];
+    snprintf(name, sizeof(name), "%016llx%016llx.apc", (unsigned long long)key.high, (unsigned long long)key.low);
+    return directory + "/" + name;
+}
+
+void CompileCache::setLimits(size_t maxEntries, size_t maxBytes){
+    this->maxEntries = maxEntries;
+    this->maxBytes = maxBytes;
+    trim();
+}
+
+void CompileCache::setDirectory(const std::string& directory){
+    this->directory = directory;
+}
+
+CompileCacheStats CompileCache::stats() const {
+    CompileCacheStats stats = counters;
+    stats.entries = entries.size();
+    return stats;
+}
+
+void CompileCache::clear(){
+    entries.clear();
+    index.clear();
+    counters.bytes = 0;
+}
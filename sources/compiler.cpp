@@ -67,14 +67,18 @@ void Compiler::parsePrecedence(Precedence precedence, bool advanceFirst) {
 }
 
 void Compiler::writeConstant(Value value){
-    int constant_position = chunk->addConstant(value);
-    assert(constant_position <= UINT8_MAX);
-    writeBytes(OP_CONSTANT, (byte) constant_position);
+    chunk->writeConstant(value, parser.previous.line);
 }
 
 void Compiler::writeString(std::string s){
-    const char* str = addString(s.c_str(), s.size());
-    writeConstant(Value(str));
+    writeConstant(Value(chunk->strings.intern(s)));
+}
+
+// A name the code assigns to or jumps through, its cell gets a slot; labels are written with writeString
+void Compiler::writeCellName(std::string s){
+    const char* name = chunk->strings.intern(s);
+    chunk->strings.addSlot(name);
+    writeConstant(Value(name));
 }
 
 
@@ -127,12 +131,14 @@ void Compiler::unary(){
     }
 }
 void Compiler::number() {
-    double value = strtod(parser.previous.start, nullptr);
+    // strtod would read on past the token, and the source may end right after it
+    double value = strtod(std::string(parser.previous.start, parser.previous.length).c_str(), nullptr);
     writeConstant(Value(value));
 }
 
 void Compiler::variable() {
-    const char* idStr = addString(parser.previous.start, parser.previous.length);
+    const char* idStr = chunk->strings.intern(parser.previous.start, parser.previous.length);
+    chunk->strings.addSlot(idStr); // the name may be dereferenced at runtime, keep its cell in the slot table
     writeConstant(Value(idStr));
 }
 
@@ -155,14 +161,16 @@ void Compiler::printStatement() {
     writeByte(OP_PRINT);
 }
 
+// Jumps are written with room for a 32-bit distance,
+// Chunk::resolveLabels shrinks them to the shortest encoding once the whole program is compiled.
 size_t Compiler::writeJump(byte command){
-    writeByte(command);
-    writeByte(0xff);
-    return chunk->count() - 1;
+    writeByte(command == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+    for(int i = 0; i < 4; i++) writeByte(0xff);
+    return chunk->count() - 5;
 }
 
-void Compiler::patchJump(size_t commandIdx){
-    chunk->code[commandIdx] = chunk->count() - commandIdx - 1;
+void Compiler::patchJump(size_t jumpIdx){
+    chunk->setJumpTarget(jumpIdx, chunk->count());
 }
 
 
@@ -213,9 +221,23 @@ void Compiler::addLabel(std::string labelName) {
 }
 
 void Compiler::Parser::setReplacements(const std::vector<ReplaceTokens>& replacements){
-    scanner.replacements.insert(scanner.replacements.end(), replacements.begin(), replacements.end());
+    for(auto& replacement : replacements) this->replacements.add(replacement);
 }
 #include "../headers/utility.h"
+
+// Token range of an R statement body and its replacements, by their text
+static std::string expansionKey(size_t begin, size_t end, const std::vector<ReplaceTokens>& replacements){
+    std::string key(reinterpret_cast<const char*>(&begin), sizeof(begin));
+    key.append(reinterpret_cast<const char*>(&end), sizeof(end));
+    for(auto& replacement : replacements)
+        for(const Token* token : {&replacement.what, &replacement.with}){
+            key.push_back((char)token->type);
+            key.append(reinterpret_cast<const char*>(&token->length), sizeof(token->length));
+            if(token->start) key.append(token->start, token->length);
+        }
+    return key;
+}
+
 void Compiler::RStatement() {
 
     parser.consume(TokenType::LEFT_CURLY, "Expected '{' after R.");
@@ -231,33 +253,44 @@ void Compiler::RStatement() {
 
     Token l1 = parser.advance(); parser.consume(TokenType::INLINE_DIVIDER, "Expected ,.");
     Token l2 = parser.advance();
-    if(l1.type != TokenType::IDENTIFIER || l2.type != TokenType::IDENTIFIER)
+    if(l1.type != TokenType::IDENTIFIER || l2.type != TokenType::IDENTIFIER) {
         parser.errorAtCurrent("Expected 2 labels after R statement.");
+        return;
+    }
 
-
-    Parser innerParser; Chunk innerChunk;
-    Compiler innerCompiler(innerParser);
-    innerParser.setReplacements(replacements);
-
-
-    std::string sl1 = addString(l1.start, l1.length);
-    std::string sl2 = addString(l2.start, l2.length);
-
-    size_t pos = std::string(source).find( sl1 + "...") + sl1.size() + 3;
-    if(pos == std::string::npos) {
-        parser.errorAtCurrent(format("Can't find label %s declaration", sl1.c_str()).c_str());
+    // the body lies between the declarations `l1...` and `l2...` in the range being compiled
+    size_t begin = tokens->findLabel(l1, from, to);
+    if(begin == TokenBuffer::NO_LABEL) {
+        parser.errorAtCurrent(format("Can't find label %.*s declaration", l1.length, l1.start).c_str());
         return;
     }
-    size_t endPos = std::string(source).find( sl2 + "...", pos);
-    if(endPos == std::string::npos) {
-        parser.errorAtCurrent(format("Can't find label %s declaration", sl2.c_str()).c_str());
+    begin += 2; // past `l1 ...`
+    size_t end = tokens->findLabel(l2, begin, to);
+    if(end == TokenBuffer::NO_LABEL) {
+        parser.errorAtCurrent(format("Can't find label %.*s declaration", l2.length, l2.start).c_str());
         return;
     }
-    const char* substringSource = addString(source + pos, endPos - pos );
 
-    innerCompiler.compile(substringSource, &innerChunk);
-    innerChunk.code.pop_back(); // remove return
-    write(innerChunk);
+    // the same body with the same replacements compiles to the same code, which write() relocates
+    std::string key = expansionKey(begin, end, replacements);
+    auto cached = expansions->bodies.find(key);
+    if(cached != expansions->bodies.end()) {
+        expansions->stats.hits++;
+        write(*cached->second);
+        return;
+    }
+    expansions->stats.misses++;
+    std::unique_ptr<Chunk> innerChunk(new Chunk);
+    Parser innerParser;
+    innerParser.errors = parser.errors;
+    Compiler innerCompiler(innerParser);
+    innerCompiler.expansions = expansions;
+    innerParser.setReplacements(replacements);
+    bool compiled = innerCompiler.compile(*tokens, begin, end, innerChunk.get());
+    innerChunk->code.pop_back(); // remove return
+    innerChunk->lines.pop_back();
+    write(*innerChunk);
+    if(compiled) expansions->bodies[key] = std::move(innerChunk); // a body with errors reports them every time
 }
 
 void Compiler::statement() {
@@ -297,15 +330,22 @@ void Compiler::writeBytes(byte byte1, byte byte2) {
 
 }
 
+void Compiler::writeShort(byte command, uint16_t operand) {
+    writeByte(command);
+    writeBytes((operand >> 8) & 0xff, operand & 0xff);
+}
+
 
 void Compiler::pointer() {
-    if(parser.match(TokenType::IDENTIFIER)){
-        const char* idStr = addString(parser.previous.start, parser.previous.length);
-        writeConstant(Value(idStr));
-    }
-    else {
-        parsePrecedence(PREC_UNARY); // evaluate lvalue value
+    if(parser.match(TokenType::IDENTIFIER)){ // literal name, address its cell through the slot table
+        const char* name = chunk->strings.intern(parser.previous.start, parser.previous.length);
+        if(parser.match(TokenType::EQUAL)){
+            expression();
+            chunk->writeSlot(OP_SET_SLOT, name, parser.previous.line);
+        } else chunk->writeSlot(OP_GET_SLOT, name, parser.previous.line);
+        return;
     }
+    parsePrecedence(PREC_UNARY); // evaluate lvalue value
     if(parser.match(TokenType::EQUAL)){ // set
         expression();
         writeByte(OP_SET_POINTER);
@@ -1,4 +1,5 @@
 #include <cstdarg>
+#include <cassert>
 #include "../headers/compiler.h"
 using namespace std;
 
@@ -13,12 +14,29 @@ void Compiler::compileConditionExpression(Chunk* chunk){
     parser.consume(TokenType::RIGHT_CURLY, "Expected '}' after predicate.");
 }
 
-bool Compiler::compile(const char*source, Chunk* chunk){
-    this->source = source;
-    parser.scanner.init(source);
+bool Compiler::compile(const char*source, size_t length, Chunk* chunk){
+    sourceTokens.scan(source, length);
+    sourceExpansions.bodies.clear(); // token ranges of another source
+    sourceExpansions.loops = 0;
+    return compile(sourceTokens, 0, sourceTokens.size(), chunk);
+}
+
+bool Compiler::compile(FILE* source, Chunk* chunk){
+    sourceTokens.stream(source);
+    sourceExpansions.bodies.clear();
+    sourceExpansions.loops = 0;
+    return compile(sourceTokens, 0, SIZE_MAX, chunk); // up to the EOF token, wherever it turns out to be
+}
+
+bool Compiler::compile(TokenBuffer& tokens, size_t from, size_t to, Chunk* chunk){
+    this->tokens = &tokens;
+    this->from = from;
+    this->to = to;
+    parser.setTokens(tokens, from, to);
     this->chunk = chunk;
     parser.hadError = false;
     parser.panicMode = false;
+    parser.current = Token(); // a statement start, for a label on the first line
 
 
     parser.advance(); // first token become parser.previous
@@ -28,18 +46,25 @@ bool Compiler::compile(const char*source, Chunk* chunk){
 }
 
 
-void Compiler::compileUntil(std::string label){
+// Returns the offset of the last statement, the one that mentions `label`
+size_t Compiler::compileUntil(std::string label){
+    const char* name = chunk->strings.intern(label);
     Value* lastval = nullptr;
+    size_t start;
     do {
+        start = chunk->count();
+        if(parser.peek(TokenType::EOF)) {
+            parser.errorAtCurrent(("Unterminated loop: no '" + label + "' before the end.").c_str());
+            return start;
+        }
         statement();
-        if(!chunk->constants.empty())
-            lastval = &chunk->constants.at(chunk->constants.size() - 1);
-    }while(lastval == nullptr || lastval->type != ValueType::STRING || lastval->val.string != label);
+        if(chunk->lastConstant >= 0)
+            lastval = &chunk->constants.at(chunk->lastConstant);
+    }while(lastval == nullptr || lastval->type() != ValueType::STRING || lastval->string() != name);
+    return start;
 }
-int Compiler::ForLoopParts::initLabel = 0;
 
 void Compiler::parseForLoopParts(ForLoopParts* parts){
-    Chunk end;
     //initialization part
     compileExpression( &parts->initialization);
 
@@ -49,27 +74,27 @@ void Compiler::parseForLoopParts(ForLoopParts* parts){
     parser.consume(TokenType::RIGHT_PAREN, "Expected ')'.");
 
     // condition part
-    bool isCondExpression = parser.match(TokenType::PR);
-    if(isCondExpression){
-        compileConditionExpression(&end);
-        parts->endCondition = end;
-    } else compileExpression(&end);
+    parts->predicate = parser.match(TokenType::PR);
+    if(parts->predicate){
+        compileConditionExpression(&parts->end);
+        parts->endCondition.write(parts->end);
+    } else compileExpression(&parts->end);
 
     //parameter part
     if(!parser.match(TokenType::EQUAL_GREATER)){
         parts->nextPart = new ForLoopParts;
         parser.consume(TokenType::INLINE_DIVIDER, "Expected either '=>' or ','.");
         parseForLoopParts(parts->nextPart);
-        parts->parameter = parts->nextPart->parameter;
+        parts->parameter.write(parts->nextPart->parameter);
     }
     else {
         compileExpression( &parts->parameter);
     }
 
-    if(!isCondExpression){ // patch the condition
+    if(!parts->predicate){ // patch the condition
         parts->endCondition.write(parts->parameter);
         parts->endCondition.write(OP_GET_POINTER, parser.current.line);
-        parts->endCondition.write(end);
+        parts->endCondition.write(parts->end);
         parts->endCondition.write(OP_LESS, parser.current.line);
     }
 }
@@ -86,19 +111,19 @@ void Compiler::writeInitPart(const vector<ForLoopParts *> &forLoopParts, string
             write(forLoop->initialization);
             writeByte(OP_SET_POINTER_WITHOUT_PUSH);
 
-            writeString(format("_cond_%d_%d", forLoopNumber, i));
+            writeCellName(format("_cond_%d_%d", forLoopNumber, i));
             writeString(format("_cond_%d_%d.%d", forLoopNumber, i, j));
             writeByte(OP_GET_LABEL);
             writeByte(OP_SET_POINTER_WITHOUT_PUSH);
 
-            if(i == 0) writeString(l1);
-            else       writeString(format("_incr_%d_%d", forLoopNumber, i));
+            if(i == 0) writeCellName(l1);
+            else       writeCellName(format("_incr_%d_%d", forLoopNumber, i));
             writeString(format("_incr_%d_%d.%d", forLoopNumber, i, j));
             writeByte(OP_GET_LABEL);
             writeByte(OP_SET_POINTER_WITHOUT_PUSH);
 
             if(j == 0 && i == forLoopParts.size() - 1 ){
-                writeString(format("_cond_%d_%d", forLoopNumber, 0)); // jump to cond begin, skip incr end
+                writeCellName(format("_cond_%d_%d", forLoopNumber, 0)); // jump to cond begin, skip incr end
                 writeByte(OP_POP);
             }
             else if(j == 0){
@@ -106,7 +131,7 @@ void Compiler::writeInitPart(const vector<ForLoopParts *> &forLoopParts, string
                 writeByte(OP_POP);
             }
             else {
-                writeString(format("_cond_%d_%d", forLoopNumber, i+1)); // jump to next condition or condition end
+                writeCellName(format("_cond_%d_%d", forLoopNumber, i+1)); // jump to next condition or condition end
                 writeByte(OP_POP);
             }
         } while (j++, forLoop = forLoop->nextPart);
@@ -128,9 +153,9 @@ void Compiler::writeIncrementPart(const std::vector<ForLoopParts*>& forLoopParts
             writeByte(OP_SET_POINTER_WITHOUT_PUSH);
             // jump from loopNum_x to loopNum_(x+1)
             if(i!= forLoopParts.size() -1)
-                writeString(format("_incr_%d_%d", forLoopNumber, i+1));
+                writeCellName(format("_incr_%d_%d", forLoopNumber, i+1));
             else
-                writeString(format("_cond_%d_%d", forLoopNumber, 0));
+                writeCellName(format("_cond_%d_%d", forLoopNumber, 0));
             writeByte(OP_POP);
         }while (j++, forLoop = forLoop->nextPart);
     }
@@ -149,15 +174,93 @@ void Compiler::writeConditionPart(const std::vector<ForLoopParts*>& forLoopParts
             writeByte(OP_JUMP_IF_FALSE_TO_LABEL);
 
             // else jump to cond 0_(i+1)
-            writeString(format("_cond_%d_%d", forLoopNumber, i+1)); // jump to next condition or condition end
+            writeCellName(format("_cond_%d_%d", forLoopNumber, i+1)); // jump to next condition or condition end
             writeByte(OP_POP);
         }while (j++, forLoop = forLoop->nextPart);
     }
     addLabel(format("_cond_%d_%d", forLoopNumber, forLoopParts.size()));
 }
 
+// A number constant, possibly negated, and nothing else
+static bool numberConstant(Chunk& expression, double& number){
+    if(expression.count() == 0) return false;
+    byte op = expression.code[0];
+    if(op != OP_CONSTANT && op != OP_CONSTANT_LONG) return false;
+    const Value& value = expression.constants[expression.constantIndex(0)];
+    if(value.type() != ValueType::NUMBER) return false;
+    size_t length = expression.instructionLength(0);
+    number = value.number();
+    if(expression.count() == length) return true;
+    if(expression.count() == length + 1 && expression.code[length] == OP_NEGATE){
+        number = -number;
+        return true;
+    }
+    return false;
+}
+
+// Loops whose ranges and parameters are all constants run on OP_LOOP_PREPARE and OP_LOOP_STEP.
+// Anything evaluated at runtime, like a PR{} condition, keeps the label lowering above.
+bool Compiler::countedLoop(const std::vector<ForLoopParts*>& forLoopParts, LoopDescriptor& loop){
+    for(auto forLoop : forLoopParts){
+        LoopPart part;
+        Chunk& parameter = forLoop->parameter;
+        if(parameter.count() == 0 || parameter.code[0] != OP_CONSTANT || parameter.count() != 2) return false;
+        part.parameter = parameter.constants[parameter.constantIndex(0)];
+        if(part.parameter.type() == ValueType::STRING) {
+            part.parameter = Value(chunk->strings.intern(part.parameter.string()));
+            chunk->strings.addSlot(part.parameter.string());
+        }
+        else if(part.parameter.type() != ValueType::NUMBER) return false;
+
+        for(auto sequence = forLoop; sequence != nullptr; sequence = sequence->nextPart){
+            LoopSequence range{};
+            if(sequence->predicate || !numberConstant(sequence->initialization, range.init) ||
+               !numberConstant(sequence->step, range.step) || !numberConstant(sequence->end, range.end))
+                return false;
+            part.sequences.push_back(range);
+        }
+        loop.parts.push_back(part);
+    }
+    return true;
+}
+
+/*
+ *  l1 = offset of step
+ *  OP_LOOP_PREPARE     every parameter = its first init, push whether all parts are below their end
+ *  jump if false l2
+ *  jump body
+ * step:
+ *  OP_LOOP_STEP        every parameter += step, push whether all parts are below their end
+ *  jump if false l2
+ * body:
+ *  ...
+ *  l1                  rewritten to jump step by loopStatement
+ */
+void Compiler::writeCountedLoop(LoopDescriptor& loop, std::string l1, std::string l2, int forLoopNumber){
+    assert(chunk->loops.size() <= UINT16_MAX);
+    uint16_t index = chunk->loops.size();
+    chunk->loops.push_back(loop);
+    std::string step = format("_step_%d", forLoopNumber);
+
+    writeCellName(l1);
+    writeString(step);
+    writeByte(OP_GET_LABEL);
+    writeByte(OP_SET_POINTER_WITHOUT_PUSH);
+
+    writeShort(OP_LOOP_PREPARE, index);
+    writeString(l2);
+    writeByte(OP_JUMP_IF_FALSE_TO_LABEL);
+    size_t bodyJump = writeJump(OP_JUMP);
+
+    addLabel(step);
+    writeShort(OP_LOOP_STEP, index);
+    writeString(l2);
+    writeByte(OP_JUMP_IF_FALSE_TO_LABEL);
+    patchJump(bodyJump);
+}
+
 void Compiler::loopStatement() {
-    static int LoopNUMBER = 0;
+    int loopNumber = expansions->loops++; // taken before the body, a loop nested in it gets its own labels
     Compiler innerComp{parser};
     Chunk l1, l2;
     vector<ForLoopParts*> forLoops;
@@ -176,16 +279,34 @@ void Compiler::loopStatement() {
     innerComp.compileExpression( &l2);
     Value cl1 = l1.constants[0];
     Value cl2 = l2.constants[0];
-    if(cl1.type != ValueType::STRING || cl2.type != ValueType::STRING)
+    if(cl1.type() != ValueType::STRING || cl2.type() != ValueType::STRING)
     {
         parser.errorAtCurrent("Expected l1, l2 labels for 'for loop'");
     }
 
-    writeInitPart(forLoops, cl1.val.string, LoopNUMBER);
-    writeIncrementPart(forLoops, LoopNUMBER);
-    writeConditionPart(forLoops, cl2.val.string, LoopNUMBER);
+    LoopDescriptor counted;
+    bool isCounted = countedLoop(forLoops, counted);
+    if(isCounted) writeCountedLoop(counted, cl1.string(), cl2.string(), loopNumber);
+    else {
+        writeInitPart(forLoops, cl1.string(), loopNumber);
+        writeIncrementPart(forLoops, loopNumber);
+        writeConditionPart(forLoops, cl2.string(), loopNumber);
+    }
 
     for(auto & forLoop : forLoops) delete forLoop;
-    compileUntil(cl1.val.string);
-    LoopNUMBER++;
+    size_t last = compileUntil(cl1.string());
+
+    // a body that ends with a bare `l1` jumps to the step directly instead of through the l1 cell,
+    // unless l1 is also a declared label, which OP_POP would prefer
+    if(isCounted && !has(chunk->labelMap, cl1.string()) && last < chunk->count() &&
+       (chunk->code[last] == OP_CONSTANT || chunk->code[last] == OP_CONSTANT_LONG) &&
+       last + chunk->instructionLength(last) + 1 == chunk->count() && chunk->code.back() == OP_POP) {
+        const Value& label = chunk->constants[chunk->constantIndex(last)];
+        if(label.type() == ValueType::STRING && label.string() == chunk->strings.intern(cl1.string())){
+            chunk->code.resize(last);
+            chunk->lines.resize(last);
+            size_t stepJump = writeJump(OP_JUMP);
+            chunk->setJumpTarget(stepJump, chunk->labelMap[format("_step_%d", loopNumber)]);
+        }
+    }
 }
@@ -2,6 +2,22 @@
 #include <iostream>
 #include "../headers/debug.h"
 using namespace std;
+
+const char* opcodeName(byte op){
+    // in OpCode order
+    static const char* names[] = {
+        "OP_RETURN", "OP_CONSTANT", "OP_NEGATE", "OP_ADD", "OP_SUBTRACT", "OP_MULTIPLY", "OP_DIVIDE",
+        "OP_NOT", "OP_LESS", "OP_EQUAL", "OP_GREATER", "OP_TRUE", "OP_FALSE", "OP_PRINT", "OP_POP",
+        "OP_SET_POINTER", "OP_SET_POINTER_WITHOUT_PUSH", "OP_GET_POINTER", "OP_SET_POINTER_INVERSE",
+        "OP_PART_END", "OP_JUMP_IF_FALSE", "OP_JUMP", "OP_EXCHANGE", "OP_JUMP_IF_FALSE_TO_LABEL",
+        "OP_GET_LABEL", "OP_JUMP_WIDE", "OP_JUMP_IF_FALSE_WIDE", "OP_GET_SLOT", "OP_SET_SLOT",
+        "OP_CONSTANT_LONG", "OP_JUMP_LONG", "OP_JUMP_IF_FALSE_LONG", "OP_LESS_EQUAL", "OP_GREATER_EQUAL",
+        "OP_NOT_EQUAL", "OP_LOOP_PREPARE", "OP_LOOP_STEP"
+    };
+    static_assert(sizeof(names) / sizeof(*names) == OP_LOOP_STEP + 1, "names are out of sync with OpCode");
+    return op <= OP_LOOP_STEP ? names[op] : "Unknown OP";
+}
+
 void disassembleInstructions(const Chunk* chunk){
     cout << "Labels:" << endl;
     for(auto i = chunk->labelMap.begin(); i != chunk->labelMap.end(); i++){
@@ -35,22 +51,119 @@ void disassembleInstructions(const Chunk* chunk){
             OP_CASE(OP_JUMP_IF_FALSE_TO_LABEL)
             OP_CASE(OP_GET_LABEL)
             OP_CASE(OP_SET_POINTER_WITHOUT_PUSH)
+            OP_CASE(OP_LESS_EQUAL)
+            OP_CASE(OP_GREATER_EQUAL)
+            OP_CASE(OP_NOT_EQUAL)
             case OP_JUMP_IF_FALSE:
-            case OP_JUMP: {
+            case OP_JUMP_IF_FALSE_WIDE:
+            case OP_JUMP_IF_FALSE_LONG:
+            case OP_JUMP:
+            case OP_JUMP_WIDE:
+            case OP_JUMP_LONG: {
                 cout << "OP_JUMP ";
-                if((OpCode)chunk->code[i] == OP_JUMP_IF_FALSE) cout << "if false ";
-                cout << (size_t)chunk->code[++i] ;
+                if(chunk->code[i] == OP_JUMP_IF_FALSE || chunk->code[i] == OP_JUMP_IF_FALSE_WIDE ||
+                   chunk->code[i] == OP_JUMP_IF_FALSE_LONG) cout << "if false ";
+                cout << "to " << chunk->jumpTarget(i) << endl;
+                i += chunk->instructionLength(i) - 1;
+                break;
+            }
+            case OP_GET_SLOT:
+            case OP_SET_SLOT: {
+                cout << ((OpCode)chunk->code[i] == OP_GET_SLOT ? "OP_GET_SLOT \t" : "OP_SET_SLOT \t");
+                cout << chunk->strings.atSlot(chunk->code[i + 1] << 8 | chunk->code[i + 2]) << endl;
+                i += 2;
+                break;
+            }
+            case OP_LOOP_PREPARE:
+            case OP_LOOP_STEP: {
+                cout << ((OpCode)chunk->code[i] == OP_LOOP_PREPARE ? "OP_LOOP_PREPARE \t" : "OP_LOOP_STEP \t");
+                const LoopDescriptor& loop = chunk->loops.at(chunk->code[i + 1] << 8 | chunk->code[i + 2]);
+                for(auto& part : loop.parts){
+                    for(auto& sequence : part.sequences)
+                        cout << sequence.init << '(' << sequence.step << ')' << sequence.end << ' ';
+                    cout << "=> " << std::string(part.parameter) << "; ";
+                }
                 cout << endl;
+                i += 2;
                 break;
             }
+            case OP_CONSTANT_LONG:
             case OP_CONSTANT:{
                 cout << "OP_CONSTANT \t";
-                chunk->constants.at(chunk->code[++i]).printValue();
+                chunk->constants.at(chunk->constantIndex(i)).printValue();
                 cout << endl;
+                i += chunk->instructionLength(i) - 1;
                 break;
             }
             default: cout << "Unknown OP :\t"  << chunk->code[i] << endl;;
         }
     }
 #undef OP_CASE
-}
\ No newline at end of file
+}
+static void printOperand(const Chunk* chunk, const RegisterCode* registers, uint32_t operand){
+    uint32_t index = operand & ~OPERAND_KIND;
+    switch (operand & OPERAND_KIND) {
+        case OPERAND_REGISTER: cout << 'r' << index; break;
+        case OPERAND_CONSTANT: registers->constants.at(index).printValue(); break;
+        default: cout << '\'' << chunk->strings.atSlot(index);
+    }
+}
+
+void disassembleRegisters(const Chunk* chunk, const RegisterCode* registers){
+    static const char* names[] = {
+        "R_MOVE", "R_NEGATE", "R_NOT", "R_ADD", "R_SUBTRACT", "R_MULTIPLY", "R_DIVIDE",
+        "R_LESS", "R_GREATER", "R_EQUAL", "R_LESS_EQUAL", "R_GREATER_EQUAL", "R_NOT_EQUAL",
+        "R_SET_SLOT", "R_PRINT", "R_POP", "R_JUMP", "R_JUMP_IF_FALSE", "R_JUMP_IF_FALSE_TO_LABEL",
+        "R_STACK", "R_RETURN", "R_PART_END"
+    };
+    cout << "Labels:" << endl;
+    for(auto i = chunk->labelMap.begin(); i != chunk->labelMap.end(); i++){
+        cout << i->first << ":\t" << registers->entries.at(i->second) << endl;
+    }
+
+    cout << " ---" << endl;
+    for(size_t i = 0; i < registers->code.size(); i++){
+        const RegisterInstruction& instruction = registers->code[i];
+        cout << '[' << i << "]\t" << names[instruction.op] << " \t";
+        switch (instruction.op) {
+            case R_MOVE:
+            case R_NEGATE:
+            case R_NOT:
+                cout << 'r' << instruction.a << ", ";
+                printOperand(chunk, registers, instruction.b);
+                break;
+            case R_SET_SLOT:
+                cout << '\'' << chunk->strings.atSlot(instruction.a) << ", ";
+                printOperand(chunk, registers, instruction.b);
+                break;
+            case R_PRINT:
+            case R_POP:
+                printOperand(chunk, registers, instruction.b);
+                break;
+            case R_JUMP:
+                cout << instruction.a;
+                break;
+            case R_JUMP_IF_FALSE:
+                printOperand(chunk, registers, instruction.b);
+                cout << ", " << instruction.a;
+                break;
+            case R_JUMP_IF_FALSE_TO_LABEL:
+                printOperand(chunk, registers, instruction.b);
+                cout << ", ";
+                printOperand(chunk, registers, instruction.c);
+                break;
+            case R_STACK:
+                cout << "op " << instruction.a << " on r0-r" << (int)instruction.b - 1;
+                break;
+            case R_RETURN:
+            case R_PART_END:
+                break;
+            default:
+                cout << 'r' << instruction.a << ", ";
+                printOperand(chunk, registers, instruction.b);
+                cout << ", ";
+                printOperand(chunk, registers, instruction.c);
+        }
+        cout << endl;
+    }
+}
@@ -0,0 +1,57 @@
+#include "../headers/mappedfile.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return;
+    struct stat info{};
+    if(fstat(fd, &info) != 0) {
+        close(fd);
+        return;
+    }
+    if(!S_ISREG(info.st_mode)) { // a pipe or a device can't be mapped
+        char block[1 << 16];
+        ssize_t got;
+        while((got = read(fd, block, sizeof(block))) > 0) buffer.insert(buffer.end(), block, block + got);
+        start = buffer.data();
+        length = buffer.size();
+        opened = got == 0;
+    } else {
+        length = info.st_size;
+        if(length == 0) opened = true; // mmap refuses empty files
+        else {
+            void* memory = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(memory != MAP_FAILED) {
+                posix_madvise(memory, length, POSIX_MADV_SEQUENTIAL); // read once, front to back
+                start = (const char*)memory;
+                mapped = opened = true;
+            }
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if(mapped) munmap((void*)start, length);
+}
+
+#else
+#include <fstream>
+
+MappedFile::MappedFile(const char* path) {
+    std::ifstream in(path, std::ios::binary);
+    if(!in) return;
+    buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    start = buffer.data();
+    length = buffer.size();
+    opened = true;
+}
+
+MappedFile::~MappedFile() = default;
+
+#endif
@@ -0,0 +1,63 @@
+#include <cassert>
+#include "../headers/memory.h"
+
+Value* CellArena::allocate(const Value& value) {
+    if(limit != 0 && cells >= limit) return nullptr;
+    if(cells == blocks.size() * BLOCK_SIZE) blocks.push_back(new Value[BLOCK_SIZE]);
+    Value* cell = &blocks[cells / BLOCK_SIZE][cells % BLOCK_SIZE];
+    *cell = value;
+    cells++;
+    return cell;
+}
+
+void CellArena::clear() {
+    for(Value* block : blocks) delete[] block;
+    blocks.clear();
+    cells = 0;
+}
+
+bool AddressSpace::isPaged(double address) {
+    return address >= 0 && address <= UINT32_MAX && address == (double)(uint32_t)address;
+}
+
+Value* AddressSpace::find(double address) {
+    if(address != address) return nullptr;
+    if(!isPaged(address)){
+        auto cell = sparse.find(address);
+        return cell == sparse.end() ? nullptr : &cell->second;
+    }
+    uint32_t a = (uint32_t)address;
+    Table table = directory[a >> (PAGE_BITS + TABLE_BITS)];
+    if(table == nullptr) return nullptr;
+    Page page = table[(a >> PAGE_BITS) & ((1 << TABLE_BITS) - 1)];
+    if(page == nullptr) return nullptr;
+    return &page[a & (PAGE_SIZE - 1)];
+}
+
+Value& AddressSpace::at(double address) {
+    assert(address == address);
+    if(!isPaged(address)) { // found without a write, the workers of Vm::runParallel share cells that are there
+        auto cell = sparse.find(address);
+        return cell == sparse.end() ? sparse[address] : cell->second;
+    }
+    uint32_t a = (uint32_t)address;
+    Table& table = directory[a >> (PAGE_BITS + TABLE_BITS)];
+    if(table == nullptr) table = new Page[(size_t)1 << TABLE_BITS]();
+    Page& page = table[(a >> PAGE_BITS) & ((1 << TABLE_BITS) - 1)];
+    if(page == nullptr) {
+        page = new Value[PAGE_SIZE];
+        pages++;
+    }
+    return page[a & (PAGE_SIZE - 1)];
+}
+
+void AddressSpace::clear() {
+    for(Table& table : directory){
+        if(table == nullptr) continue;
+        for(size_t i = 0; i < ((size_t)1 << TABLE_BITS); i++) delete[] table[i];
+        delete[] table;
+        table = nullptr;
+    }
+    sparse.clear();
+    pages = 0;
+}
@@ -0,0 +1,169 @@
+#include "../headers/optimizer.h"
+#include "../headers/assembler.h"
+
+static bool isJump(byte op){
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE;
+}
+
+// Instructions something jumps to, or a label points at. Their boundary must stay.
+static std::vector<bool> targets(const Assembly& assembly){
+    std::vector<bool> target(assembly.instructions.size() + 1, false);
+    for(auto& instruction : assembly.instructions)
+        if(isJump(instruction.op)) target[instruction.operand] = true;
+    for(auto& label : assembly.labels) target[label.second] = true;
+    return target;
+}
+
+static bool isNumber(const Chunk& chunk, const Instruction& instruction, double& number){
+    if(instruction.op != OP_CONSTANT) return false;
+    const Value& value = chunk.constants[instruction.operand];
+    if(value.type() != ValueType::NUMBER) return false;
+    number = value.number();
+    return true;
+}
+
+// Same truth as Vm::isFalsey for what can be known before running
+static bool knownFalsey(const Chunk& chunk, const Instruction& instruction, bool& falsey){
+    double number;
+    if(instruction.op == OP_TRUE || instruction.op == OP_FALSE) falsey = instruction.op == OP_FALSE;
+    else if(isNumber(chunk, instruction, number)) falsey = number != 0;
+    else return false;
+    return true;
+}
+
+static void setBool(Instruction& instruction, bool value){
+    instruction.op = value ? OP_TRUE : OP_FALSE;
+    instruction.operand = 0;
+}
+
+static void setNumber(Chunk& chunk, Instruction& instruction, double value){
+    instruction.op = OP_CONSTANT;
+    instruction.operand = chunk.addConstant(Value(value));
+}
+
+static bool fuseComparisons(Assembly& assembly){
+    std::vector<Instruction>& ins = assembly.instructions;
+    std::vector<bool> target = targets(assembly);
+    std::vector<bool> removed(ins.size(), false);
+    bool changed = false;
+    for(size_t i = 0; i + 1 < ins.size(); i++){
+        if(ins[i + 1].op != OP_NOT || target[i + 1]) continue;
+        switch (ins[i].op) {
+            case OP_GREATER: ins[i].op = OP_LESS_EQUAL; break;
+            case OP_LESS: ins[i].op = OP_GREATER_EQUAL; break;
+            case OP_EQUAL: ins[i].op = OP_NOT_EQUAL; break;
+            default: continue;
+        }
+        removed[++i] = true;
+        changed = true;
+    }
+    if(changed) assembly.remove(removed);
+    return changed;
+}
+
+static bool foldConstants(Chunk& chunk, Assembly& assembly){
+    std::vector<Instruction>& ins = assembly.instructions;
+    std::vector<bool> target = targets(assembly);
+    std::vector<bool> removed(ins.size(), false);
+    bool changed = false;
+    for(size_t i = 0; i + 1 < ins.size(); i++){
+        double a, b;
+        bool falsey;
+        // number number op
+        if(i + 2 < ins.size() && !target[i + 1] && !target[i + 2] &&
+           isNumber(chunk, ins[i], a) && isNumber(chunk, ins[i + 1], b)){
+            bool folded = true;
+            switch (ins[i + 2].op) {
+                case OP_ADD: setNumber(chunk, ins[i], a + b); break;
+                case OP_SUBTRACT: setNumber(chunk, ins[i], a - b); break;
+                case OP_MULTIPLY: setNumber(chunk, ins[i], a * b); break;
+                case OP_DIVIDE: setNumber(chunk, ins[i], a / b); break;
+                case OP_LESS: setBool(ins[i], a < b); break;
+                case OP_GREATER: setBool(ins[i], a > b); break;
+                case OP_EQUAL: setBool(ins[i], a == b); break;
+                case OP_LESS_EQUAL: setBool(ins[i], !(a > b)); break;
+                case OP_GREATER_EQUAL: setBool(ins[i], !(a < b)); break;
+                case OP_NOT_EQUAL: setBool(ins[i], !(a == b)); break;
+                default: folded = false;
+            }
+            if(folded){
+                removed[i + 1] = removed[i + 2] = true;
+                changed = true;
+                i += 2;
+                continue;
+            }
+        }
+        if(target[i + 1]) continue;
+        // number -
+        if(ins[i + 1].op == OP_NEGATE && isNumber(chunk, ins[i], a)){
+            setNumber(chunk, ins[i], -a);
+            removed[++i] = changed = true;
+        }
+        // known !
+        else if(ins[i + 1].op == OP_NOT && knownFalsey(chunk, ins[i], falsey)){
+            setBool(ins[i], falsey);
+            removed[++i] = changed = true;
+        }
+        // known condition, jump if false
+        else if(ins[i + 1].op == OP_JUMP_IF_FALSE && knownFalsey(chunk, ins[i], falsey)){
+            if(falsey) {
+                ins[i].op = OP_JUMP;
+                ins[i].operand = ins[i + 1].operand;
+            } else removed[i] = true;
+            removed[++i] = changed = true;
+        }
+    }
+    if(changed) assembly.remove(removed);
+    return changed;
+}
+
+static bool threadJumps(Assembly& assembly){
+    std::vector<Instruction>& ins = assembly.instructions;
+    std::vector<bool> removed(ins.size(), false);
+    bool changed = false;
+    for(size_t i = 0; i < ins.size(); i++){
+        if(!isJump(ins[i].op)) continue;
+        size_t to = ins[i].operand;
+        for(size_t hops = 0; to < ins.size() && ins[to].op == OP_JUMP && ins[to].operand != to && hops < ins.size(); hops++)
+            to = ins[to].operand;
+        if(to != ins[i].operand){
+            ins[i].operand = to;
+            changed = true;
+        }
+        if(ins[i].op == OP_JUMP && to < ins.size() && ins[to].op == OP_RETURN){
+            ins[i].op = OP_RETURN;
+            ins[i].operand = 0;
+            changed = true;
+        } else if(ins[i].op == OP_JUMP && to == i + 1){
+            removed[i] = changed = true;
+        }
+    }
+    if(changed) assembly.remove(removed);
+    return changed;
+}
+
+static bool removeDeadCode(Assembly& assembly){
+    std::vector<Instruction>& ins = assembly.instructions;
+    std::vector<bool> target = targets(assembly);
+    std::vector<bool> removed(ins.size(), false);
+    bool changed = false;
+    for(size_t i = 0; i < ins.size(); i++){
+        if(ins[i].op != OP_RETURN && ins[i].op != OP_JUMP) continue;
+        while (i + 1 < ins.size() && !target[i + 1])
+            removed[++i] = changed = true;
+    }
+    if(changed) assembly.remove(removed);
+    return changed;
+}
+
+void optimize(Chunk& chunk) {
+    Assembly assembly(chunk);
+    bool changed = true;
+    while (changed) {
+        changed = fuseComparisons(assembly);
+        changed |= foldConstants(chunk, assembly);
+        changed |= threadJumps(assembly);
+        changed |= removeDeadCode(assembly);
+    }
+    assembly.assemble(chunk);
+}
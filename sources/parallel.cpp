@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <map>
+#include "../headers/parallel.h"
+#include "../headers/vm.h"
+
+namespace {
+
+enum class Kind : byte { NUMBER, BOOL, STRING };
+
+// A value the body would have on its stack, as far as it is known before it runs
+struct Abstract {
+    Kind kind;
+    uint32_t expression; // of a NUMBER computed from constants, the parameter and named cells
+    uint32_t name; // slot of a STRING
+};
+
+bool jumpsAlways(byte op){
+    return op == OP_JUMP || op == OP_JUMP_WIDE || op == OP_JUMP_LONG;
+}
+
+uint16_t operand(const Chunk& chunk, size_t offset){
+    return chunk.code[offset + 1] << 8 | chunk.code[offset + 2];
+}
+
+class Analysis {
+public:
+    Analysis(const Chunk& chunk, ParallelLoop& loop): chunk(chunk), loop(loop){}
+    bool run();
+
+private:
+    const Chunk& chunk;
+    ParallelLoop& loop;
+    std::vector<Abstract> stack;
+    bool reachable{true};
+    std::map<size_t, std::vector<Abstract>> atTarget; // stack on the jumps to an offset
+    std::vector<std::pair<size_t, size_t>> skips; // forward jumps: code between them and their target is conditional
+    std::vector<size_t> accessAt; // offset of each access
+
+    bool locate();
+    bool instruction(size_t offset);
+    bool merge(std::vector<Abstract>& into, const std::vector<Abstract>& from);
+    bool enter(size_t offset);
+    bool jump(size_t offset);
+    uint32_t expression(LoopExpression::Kind kind, uint32_t left = ParallelLoop::NO_EXPRESSION,
+                        uint32_t right = ParallelLoop::NO_EXPRESSION);
+    bool push(Abstract value);
+    bool pop(Abstract& value);
+    bool popNumber(Abstract& value);
+    bool arithmetic(LoopExpression::Kind kind);
+    bool access(uint32_t address, bool write, size_t offset);
+};
+
+// The loop is one part of one sequence counting a named cell up, the body is entered from OP_LOOP_PREPARE
+// through `l2; OP_JUMP_IF_FALSE_TO_LABEL; jump body`, or the jump to l2 resolveLabels made of the first two,
+// and ends on the jump back to its OP_LOOP_STEP.
+bool Analysis::locate(){
+    uint16_t index = operand(chunk, loop.prepare);
+    const LoopDescriptor& descriptor = chunk.loops[index];
+    if(descriptor.parts.size() != 1 || descriptor.parts[0].sequences.size() != 1) return false;
+    const LoopPart& part = descriptor.parts[0];
+    if(part.parameter.type() != ValueType::STRING || !(part.sequences[0].step > 0)) return false;
+    loop.parameter = StringPool::slotOf(part.parameter.string());
+
+    size_t at = loop.prepare + chunk.instructionLength(loop.prepare);
+    if(at < chunk.count() && (chunk.code[at] == OP_CONSTANT || chunk.code[at] == OP_CONSTANT_LONG)) {
+        at += chunk.instructionLength(at);
+        if(at >= chunk.count() || chunk.code[at] != OP_JUMP_IF_FALSE_TO_LABEL) return false;
+    } else if(at >= chunk.count() || !Chunk::isJump(chunk.code[at]) || jumpsAlways(chunk.code[at])) return false;
+    at += chunk.instructionLength(at);
+    if(at >= chunk.count() || !jumpsAlways(chunk.code[at])) return false;
+    loop.body = chunk.jumpTarget(at);
+
+    // jump threading can leave jumps to the step inside the body too, the last one has no code of the body after it
+    size_t furthest = loop.body;
+    for(size_t i = loop.body; i < chunk.count(); i += chunk.instructionLength(i)){
+        byte op = chunk.code[i];
+        if(op == OP_RETURN || op == OP_PART_END) return false;
+        if(!Chunk::isJump(op)) continue;
+        size_t target = chunk.jumpTarget(i);
+        if(target < chunk.count() && chunk.code[target] == OP_LOOP_STEP && operand(chunk, target) == index){
+            if(!jumpsAlways(op) || i < furthest) continue;
+            loop.step = target;
+            loop.end = i;
+            return true;
+        }
+        furthest = std::max(furthest, target);
+    }
+    return false;
+}
+
+uint32_t Analysis::expression(LoopExpression::Kind kind, uint32_t left, uint32_t right){
+    bool unary = kind == LoopExpression::NEGATE, binary = kind >= LoopExpression::ADD;
+    if(((unary || binary) && left == ParallelLoop::NO_EXPRESSION) || (binary && right == ParallelLoop::NO_EXPRESSION))
+        return ParallelLoop::NO_EXPRESSION;
+    loop.expressions.push_back({kind, 0, 0, left, right});
+    return loop.expressions.size() - 1;
+}
+
+bool Analysis::push(Abstract value){
+    if(stack.size() == STACK_MAX) return false;
+    stack.push_back(value);
+    return true;
+}
+
+bool Analysis::pop(Abstract& value){
+    if(stack.empty()) return false; // the body would take a value from below the loop
+    value = stack.back();
+    stack.pop_back();
+    return true;
+}
+
+// Arithmetic and comparisons only see numbers, so they can't stop the loop with an error
+bool Analysis::popNumber(Abstract& value){
+    return pop(value) && value.kind == Kind::NUMBER;
+}
+
+bool Analysis::arithmetic(LoopExpression::Kind kind){
+    Abstract left{}, right{};
+    if(!popNumber(right) || !popNumber(left)) return false;
+    return push({Kind::NUMBER, expression(kind, left.expression, right.expression), 0});
+}
+
+bool Analysis::access(uint32_t address, bool write, size_t offset){
+    if(address == ParallelLoop::NO_EXPRESSION) return false; // comes from a cell, known only while it runs
+    loop.accesses.push_back({address, write, false});
+    accessAt.push_back(offset);
+    return true;
+}
+
+// Paths meeting at a jump target must agree on the stack; a number they compute differently is just a number
+bool Analysis::merge(std::vector<Abstract>& into, const std::vector<Abstract>& from){
+    if(into.size() != from.size()) return false;
+    for(size_t i = 0; i < into.size(); i++){
+        if(into[i].kind != from[i].kind) return false;
+        if(into[i].kind == Kind::STRING && into[i].name != from[i].name) return false;
+        if(into[i].expression != from[i].expression) into[i].expression = ParallelLoop::NO_EXPRESSION;
+    }
+    return true;
+}
+
+bool Analysis::enter(size_t offset){
+    auto target = atTarget.find(offset);
+    if(target == atTarget.end()) return true;
+    if(reachable) return merge(stack, target->second);
+    stack = target->second;
+    reachable = true;
+    return true;
+}
+
+bool Analysis::jump(size_t offset){
+    size_t target = chunk.jumpTarget(offset);
+    if(target == loop.step) target = loop.end; // a threaded jump back
+    if(target <= offset || target > loop.end) return false;
+    auto known = atTarget.find(target);
+    if(known == atTarget.end()) atTarget[target] = stack;
+    else if(!merge(known->second, stack)) return false;
+    skips.emplace_back(offset, target);
+    return true;
+}
+
+bool Analysis::instruction(size_t offset){
+    Abstract value{}, other{};
+    byte op = chunk.code[offset];
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: {
+            const Value& constant = chunk.constants[chunk.constantIndex(offset)];
+            if(constant.type() == ValueType::NUMBER) {
+                uint32_t index = expression(LoopExpression::CONSTANT);
+                loop.expressions[index].constant = constant.number();
+                return push({Kind::NUMBER, index, 0});
+            }
+            if(constant.type() == ValueType::STRING) { // a name without a slot has its cell in Vm::pMap
+                uint32_t slot = StringPool::slotOf(constant.string());
+                return slot != StringPool::NO_SLOT && push({Kind::STRING, ParallelLoop::NO_EXPRESSION, slot});
+            }
+            if(constant.type() == ValueType::BOOL) return push({Kind::BOOL, ParallelLoop::NO_EXPRESSION, 0});
+            return false;
+        }
+        case OP_TRUE:
+        case OP_FALSE:
+            return push({Kind::BOOL, ParallelLoop::NO_EXPRESSION, 0});
+        case OP_GET_SLOT: {
+            uint16_t slot = operand(chunk, offset);
+            if(slot == loop.parameter) return push({Kind::NUMBER, expression(LoopExpression::PARAMETER), 0});
+            if(std::find(loop.slotsRead.begin(), loop.slotsRead.end(), slot) == loop.slotsRead.end())
+                loop.slotsRead.push_back(slot);
+            uint32_t index = expression(LoopExpression::SLOT);
+            loop.expressions[index].slot = slot;
+            return push({Kind::NUMBER, index, 0});
+        }
+        case OP_NEGATE:
+            if(!popNumber(value)) return false;
+            return push({Kind::NUMBER, expression(LoopExpression::NEGATE, value.expression), 0});
+        case OP_NOT:
+            return pop(value) && push({Kind::BOOL, ParallelLoop::NO_EXPRESSION, 0});
+        case OP_ADD: return arithmetic(LoopExpression::ADD);
+        case OP_SUBTRACT: return arithmetic(LoopExpression::SUBTRACT);
+        case OP_MULTIPLY: return arithmetic(LoopExpression::MULTIPLY);
+        case OP_DIVIDE: return arithmetic(LoopExpression::DIVIDE);
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+            return popNumber(value) && popNumber(other) && push({Kind::BOOL, ParallelLoop::NO_EXPRESSION, 0});
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            return pop(value) && pop(other) && push({Kind::BOOL, ParallelLoop::NO_EXPRESSION, 0});
+        case OP_PRINT:
+            if(!pop(value)) return false;
+            if(value.kind == Kind::STRING && value.name != loop.parameter &&
+               std::find(loop.namesPrinted.begin(), loop.namesPrinted.end(), value.name) == loop.namesPrinted.end())
+                loop.namesPrinted.push_back(value.name);
+            return true;
+        case OP_POP:
+            return pop(value) && value.kind != Kind::STRING; // dropping a name jumps to its label
+        case OP_GET_POINTER:
+            if(!popNumber(value) || !access(value.expression, false, offset)) return false;
+            return push({Kind::NUMBER, ParallelLoop::NO_EXPRESSION, 0});
+        case OP_SET_POINTER:
+        case OP_SET_POINTER_WITHOUT_PUSH:
+            // a name as the value would make the cell an alias, a bool can't be assigned
+            if(!popNumber(value) || !popNumber(other) || !access(other.expression, true, offset)) return false;
+            return op == OP_SET_POINTER_WITHOUT_PUSH || push(value);
+        case OP_JUMP:
+        case OP_JUMP_WIDE:
+        case OP_JUMP_LONG:
+            if(!jump(offset)) return false;
+            reachable = false;
+            return true;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_WIDE:
+        case OP_JUMP_IF_FALSE_LONG:
+            return pop(value) && jump(offset);
+        default:
+            // named cells written, labels, nested loops, exchanges and references
+            return false;
+    }
+}
+
+bool Analysis::run(){
+    if(!locate()) return false;
+    for(size_t i = loop.body; i < loop.end; i += chunk.instructionLength(i)){
+        if(!enter(i)) return false;
+        if(reachable && !instruction(i)) return false;
+    }
+    // each pass starts from the stack the loop started with
+    if(!enter(loop.end) || !reachable || !stack.empty()) return false;
+    for(size_t i = 0; i < loop.accesses.size(); i++)
+        for(auto& skip : skips)
+            if(skip.first < accessAt[i] && accessAt[i] < skip.second) loop.accesses[i].conditional = true;
+    return true;
+}
+
+}
+
+bool analyzeLoop(const Chunk& chunk, size_t prepare, ParallelLoop& loop){
+    loop.prepare = prepare;
+    if(!Analysis(chunk, loop).run() || loop.step > loop.body) return false;
+    loop.code.assign(chunk.code.begin() + loop.step, chunk.code.begin() + loop.end + chunk.instructionLength(loop.end));
+    loop.code[0] = OP_PART_END;
+    return true;
+}
+
+double evaluate(const ParallelLoop& loop, uint32_t expression, double parameter, const std::vector<Value*>& slots){
+    const LoopExpression& e = loop.expressions[expression];
+    switch (e.kind) {
+        case LoopExpression::CONSTANT: return e.constant;
+        case LoopExpression::PARAMETER: return parameter;
+        case LoopExpression::SLOT: return slots[e.slot]->pointTo()->number();
+        case LoopExpression::NEGATE: return -evaluate(loop, e.left, parameter, slots);
+        default: break;
+    }
+    double left = evaluate(loop, e.left, parameter, slots);
+    double right = evaluate(loop, e.right, parameter, slots);
+    switch (e.kind) {
+        case LoopExpression::ADD: return right + left; // OP_ADD adds the top to the one below
+        case LoopExpression::SUBTRACT: return left - right;
+        case LoopExpression::MULTIPLY: return left * right;
+        default: return left / right;
+    }
+}
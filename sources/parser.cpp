@@ -30,15 +30,15 @@ bool Compiler::Parser::previousEqual(int num, ...) const{
 
 void Compiler::Parser::errorAt(Token& token, const char *message) {
     if(panicMode) return;
-    fprintf(stderr, "[line %d] Compiler error", token.line);
+    fprintf(errors, "[line %d] Compiler error", token.line);
 
     switch (token.type) {
-        case TokenType::EOF: fprintf(stderr, " at end"); break;
+        case TokenType::EOF: fprintf(errors, " at end"); break;
         case TokenType::ERROR: break;
-        default: fprintf(stderr, " at '%.*s'", token.length, token.start);
+        default: fprintf(errors, " at '%.*s'", token.length, token.start);
     }
 
-    fprintf(stderr, ": %s\n", message);
+    fprintf(errors, ": %s\n", message);
     hadError = true;
 }
 
@@ -57,10 +57,17 @@ bool Compiler::Parser::peek(TokenType type) const{
 }
 
 
+void Compiler::Parser::setTokens(TokenBuffer& buffer, size_t from, size_t to){
+    tokens = &buffer;
+    next = from;
+    end = to;
+}
+
 Token Compiler::Parser::advance(){
     previous = current;
     while(true){
-        current = scanner.scanToken();
+        current = next < end && tokens->reach(next) ? tokens->at(next++) : Token{TokenType::EOF};
+        if(!replacements.empty()) current = replacements.replace(current);
         if(current.type != TokenType::ERROR) break;
         errorAtCurrent(current.start);
     }
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include "../headers/profiler.h"
+#include "../headers/debug.h"
+
+const char* Profiler::tickUnit(){
+#if defined(__x86_64__) || defined(__i386__)
+    return "cycles";
+#else
+    return "ns";
+#endif
+}
+
+void Profiler::begin(const Chunk& chunk){
+    this->chunk = &chunk;
+    offsets.assign(chunk.code.size() + 1, Counter{0, 0});
+    current = &offsets.back();
+    last = ticks();
+}
+
+void Profiler::end(){
+    current->ticks += ticks() - last;
+    current = nullptr;
+
+    std::vector<int> lines = chunk->lines; // still there when the chunk was not finalized
+    lines.resize(chunk->code.size());
+    size_t offset = 0;
+    for(auto& run : chunk->lineRuns)
+        for(uint32_t i = 0; i < run.count && offset < lines.size(); i++) lines[offset++] = run.line;
+
+    // labels by offset, a region runs up to the next label
+    std::vector<std::pair<size_t, const std::string*>> starts;
+    for(auto& label : chunk->labelMap) starts.emplace_back(label.second, &label.first);
+    std::sort(starts.begin(), starts.end());
+
+    auto region = starts.begin();
+    std::string noLabel = "(start)";
+    for(offset = 0; offset < chunk->code.size(); offset++){
+        while(region != starts.end() && region->first <= offset) ++region;
+        const Counter& counter = offsets[offset];
+        if(counter.count == 0) continue;
+        byte op = chunk->code[offset];
+        const std::string& label = region == starts.begin() ? noLabel : *(region - 1)->second;
+        spots.push_back({runs, offset, op, lines[offset], label, counter});
+        if(op <= OP_LOOP_STEP){
+            opcodes[op].count += counter.count;
+            opcodes[op].ticks += counter.ticks;
+        }
+        Counter& total = labels[label];
+        total.count += counter.count;
+        total.ticks += counter.ticks;
+        this->total.count += counter.count;
+        this->total.ticks += counter.ticks;
+    }
+    runs++;
+    offsets.clear();
+    offsets.shrink_to_fit();
+    chunk = nullptr;
+}
+
+static double share(uint64_t part, uint64_t whole){
+    return whole == 0 ? 0 : 100.0 * part / whole;
+}
+
+void Profiler::report(FILE* out, size_t hotSpots) const {
+    const char* unit = tickUnit();
+    fprintf(out, "== profile: %llu instructions, %llu %s, %zu run%s ==\n",
+            (unsigned long long)total.count, (unsigned long long)total.ticks, unit, runs, runs == 1 ? "" : "s");
+
+    std::vector<byte> ops;
+    for(int op = 0; op <= OP_LOOP_STEP; op++) if(opcodes[op].count) ops.push_back(op);
+    std::sort(ops.begin(), ops.end(), [this](byte a, byte b){ return opcodes[a].ticks > opcodes[b].ticks; });
+    fprintf(out, "\nopcodes:\n%-28s %14s %16s %7s %10s\n", "", "count", unit, "%", "per op");
+    for(byte op : ops){
+        const Counter& counter = opcodes[op];
+        fprintf(out, "%-28s %14llu %16llu %6.2f%% %10.1f\n", opcodeName(op), (unsigned long long)counter.count,
+                (unsigned long long)counter.ticks, share(counter.ticks, total.ticks), (double)counter.ticks / counter.count);
+    }
+
+    std::vector<std::pair<std::string, Counter>> regions(labels.begin(), labels.end());
+    std::sort(regions.begin(), regions.end(), [](const std::pair<std::string, Counter>& a, const std::pair<std::string, Counter>& b){
+        return a.second.ticks > b.second.ticks;
+    });
+    fprintf(out, "\nlabels:\n%-28s %14s %16s %7s\n", "", "count", unit, "%");
+    for(auto& region : regions)
+        fprintf(out, "%-28s %14llu %16llu %6.2f%%\n", region.first.c_str(), (unsigned long long)region.second.count,
+                (unsigned long long)region.second.ticks, share(region.second.ticks, total.ticks));
+
+    std::vector<const Spot*> hottest;
+    for(auto& spot : spots) hottest.push_back(&spot);
+    size_t shown = std::min(hotSpots, hottest.size());
+    std::partial_sort(hottest.begin(), hottest.begin() + shown, hottest.end(), [](const Spot* a, const Spot* b){
+        return a->counter.ticks > b->counter.ticks;
+    });
+    fprintf(out, "\nhot spots:\n%4s %8s %6s %-28s %-16s %14s %16s %7s\n", "run", "offset", "line", "", "label", "count", unit, "%");
+    for(size_t i = 0; i < shown; i++){
+        const Spot& spot = *hottest[i];
+        fprintf(out, "%4zu %8zu %6d %-28s %-16s %14llu %16llu %6.2f%%\n", spot.run, spot.offset, spot.line,
+                opcodeName(spot.op), spot.label.c_str(), (unsigned long long)spot.counter.count,
+                (unsigned long long)spot.counter.ticks, share(spot.counter.ticks, total.ticks));
+    }
+}
+
+static void writeString(FILE* out, const std::string& text){
+    fputc('"', out);
+    for(unsigned char c : text){
+        if(c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if(c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+bool Profiler::writeJson(const char* path) const {
+    FILE* out = fopen(path, "w");
+    if(out == nullptr) return false;
+
+    fprintf(out, "{\n  \"unit\": \"%s\",\n  \"runs\": %zu,\n  \"count\": %llu,\n  \"ticks\": %llu,\n  \"opcodes\": [",
+            tickUnit(), runs, (unsigned long long)total.count, (unsigned long long)total.ticks);
+    const char* separator = "\n";
+    for(int op = 0; op <= OP_LOOP_STEP; op++){
+        if(opcodes[op].count == 0) continue;
+        fprintf(out, "%s    {\"op\": \"%s\", \"count\": %llu, \"ticks\": %llu}", separator, opcodeName(op),
+                (unsigned long long)opcodes[op].count, (unsigned long long)opcodes[op].ticks);
+        separator = ",\n";
+    }
+    fprintf(out, "\n  ],\n  \"labels\": [");
+    separator = "\n";
+    for(auto& region : labels){
+        fprintf(out, "%s    {\"label\": ", separator);
+        writeString(out, region.first);
+        fprintf(out, ", \"count\": %llu, \"ticks\": %llu}", (unsigned long long)region.second.count,
+                (unsigned long long)region.second.ticks);
+        separator = ",\n";
+    }
+    fprintf(out, "\n  ],\n  \"offsets\": [");
+    separator = "\n";
+    for(auto& spot : spots){
+        fprintf(out, "%s    {\"run\": %zu, \"offset\": %zu, \"line\": %d, \"op\": \"%s\", \"label\": ", separator,
+                spot.run, spot.offset, spot.line, opcodeName(spot.op));
+        writeString(out, spot.label);
+        fprintf(out, ", \"count\": %llu, \"ticks\": %llu}", (unsigned long long)spot.counter.count,
+                (unsigned long long)spot.counter.ticks);
+        separator = ",\n";
+    }
+    fprintf(out, "\n  ]\n}\n");
+    return fclose(out) == 0;
+}
@@ -0,0 +1,243 @@
+#include <map>
+#include "../headers/registers.h"
+#include "../headers/vm.h"
+
+const uint32_t RegisterCode::NO_ENTRY;
+
+namespace {
+
+// A value the stack VM would have on its stack. Constants and named cells stay operands
+// until something needs them in their register.
+struct Entry {
+    uint32_t operand;
+    bool maybeString; // could be a label name, which makes dropping it a jump
+};
+
+class Translation {
+public:
+    Translation(const Chunk& chunk, RegisterCode& registers): chunk(chunk), out(registers){}
+    bool run();
+
+private:
+    const Chunk& chunk;
+    RegisterCode& out;
+    std::vector<Entry> stack;
+    std::map<size_t, size_t> depthAt; // depth expected at a jump target
+    std::map<size_t, uint32_t> targetAt; // first instruction of a jump target
+    std::vector<std::pair<size_t, size_t>> jumps; // instruction, stack offset of its target
+    uint32_t origin{0};
+    uint32_t trueConstant{RegisterCode::NO_ENTRY}, falseConstant{RegisterCode::NO_ENTRY};
+
+    void emit(byte op, uint32_t a, uint32_t b = 0, uint32_t c = 0){
+        out.code.push_back({op, a, b, c, origin});
+    }
+    uint32_t depth() const { return stack.size(); }
+    bool push(Entry entry){
+        if(stack.size() == STACK_MAX) return false;
+        stack.push_back(entry);
+        return true;
+    }
+    bool pop(Entry& entry){
+        if(stack.empty()) return false;
+        entry = stack.back();
+        stack.pop_back();
+        return true;
+    }
+    void materialize(size_t at){
+        Entry& entry = stack[at];
+        if((entry.operand & OPERAND_KIND) == OPERAND_REGISTER) return;
+        emit(R_MOVE, at, entry.operand);
+        entry.operand = at | OPERAND_REGISTER;
+    }
+    void materializeAll(){
+        for(size_t i = 0; i < stack.size(); i++) materialize(i);
+    }
+    // Named cells still on the stack are read before anything else runs, as the stack VM would have
+    void materializeSlots(){
+        for(size_t i = 0; i < stack.size(); i++)
+            if((stack[i].operand & OPERAND_KIND) == OPERAND_SLOT) materialize(i);
+    }
+    uint32_t boolConstant(bool value){
+        uint32_t& index = value ? trueConstant : falseConstant;
+        if(index == RegisterCode::NO_ENTRY){
+            index = out.constants.size();
+            out.constants.emplace_back(value);
+        }
+        return index | OPERAND_CONSTANT;
+    }
+    bool jump(byte op, size_t target, uint32_t condition = 0);
+    bool enter(size_t offset, bool fallsThrough, bool isTarget);
+    bool unary(byte op);
+    bool binary(byte op);
+    bool stackInstruction(byte op, int pops, int pushes, bool maybeString, uint32_t operand = 0);
+};
+
+bool Translation::jump(byte op, size_t target, uint32_t condition){
+    materializeAll();
+    auto expected = depthAt.find(target);
+    if(expected != depthAt.end() && expected->second != depth()) return false;
+    depthAt[target] = depth();
+    jumps.emplace_back(out.code.size(), target);
+    emit(op, 0, condition);
+    return true;
+}
+
+// Sets up the stack at the start of an instruction. Jump targets start with every value in its register.
+bool Translation::enter(size_t offset, bool fallsThrough, bool isTarget){
+    auto expected = depthAt.find(offset);
+    if(fallsThrough){
+        if(expected != depthAt.end() && expected->second != depth()) return false;
+    } else {
+        // only reachable by a jump, or by a label computed at runtime, which always comes with an empty stack
+        stack.assign(expected == depthAt.end() ? 0 : expected->second, Entry{0, true});
+        for(size_t i = 0; i < stack.size(); i++) stack[i].operand = i | OPERAND_REGISTER;
+    }
+    if(isTarget){
+        materializeAll();
+        for(auto& entry : stack) entry.maybeString = true;
+        depthAt[offset] = depth();
+        targetAt[offset] = out.code.size();
+    }
+    if(stack.empty()) out.entries[offset] = out.code.size();
+    return true;
+}
+
+bool Translation::unary(byte op){
+    Entry value{};
+    if(!pop(value)) return false;
+    materializeSlots();
+    emit(op, depth(), value.operand);
+    return push({depth() | OPERAND_REGISTER, false});
+}
+
+bool Translation::binary(byte op){
+    Entry left{}, right{};
+    if(!pop(right) || !pop(left)) return false;
+    materializeSlots();
+    emit(op, depth(), left.operand, right.operand);
+    return push({depth() | OPERAND_REGISTER, false});
+}
+
+// Instructions without a register form run on the stack VM code, with their operands in place
+bool Translation::stackInstruction(byte op, int pops, int pushes, bool maybeString, uint32_t operand){
+    materializeAll();
+    if(stack.size() < (size_t)pops) return false;
+    emit(R_STACK, op, depth(), operand);
+    stack.resize(stack.size() - pops);
+    for(int i = 0; i < pushes; i++)
+        if(!push({depth() | OPERAND_REGISTER, maybeString})) return false;
+    return true;
+}
+
+bool Translation::run(){
+    out.code.clear();
+    out.constants = chunk.constants;
+    out.entries.assign(chunk.code.size() + 1, RegisterCode::NO_ENTRY);
+
+    std::vector<bool> isTarget(chunk.code.size() + 1, false);
+    for(size_t i = 0; i < chunk.code.size(); i += chunk.instructionLength(i))
+        if(Chunk::isJump(chunk.code[i])) isTarget[chunk.jumpTarget(i)] = true;
+    for(auto& label : chunk.labelMap) isTarget[label.second] = true;
+
+    bool fallsThrough = true;
+    for(size_t i = 0; i < chunk.code.size(); i += chunk.instructionLength(i)){
+        origin = i;
+        if(!enter(i, fallsThrough, isTarget[i])) return false;
+        fallsThrough = true;
+        Entry value{};
+        byte op = chunk.code[i];
+        bool ok = true;
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG: {
+                uint32_t index = chunk.constantIndex(i);
+                ok = push({index | OPERAND_CONSTANT, chunk.constants[index].type() == ValueType::STRING});
+                break;
+            }
+            case OP_TRUE:
+            case OP_FALSE:
+                ok = push({boolConstant(op == OP_TRUE), false});
+                break;
+            case OP_GET_SLOT:
+                ok = push({(uint32_t)(chunk.code[i + 1] << 8 | chunk.code[i + 2]) | OPERAND_SLOT, true});
+                break;
+            case OP_SET_SLOT:
+                if(stack.empty()) return false;
+                materializeSlots(); // the assigned value stays on the stack, it must not be read again
+                emit(R_SET_SLOT, chunk.code[i + 1] << 8 | chunk.code[i + 2], stack.back().operand);
+                break;
+            case OP_NEGATE: ok = unary(R_NEGATE); break;
+            case OP_NOT: ok = unary(R_NOT); break;
+            case OP_ADD: ok = binary(R_ADD); break;
+            case OP_SUBTRACT: ok = binary(R_SUBTRACT); break;
+            case OP_MULTIPLY: ok = binary(R_MULTIPLY); break;
+            case OP_DIVIDE: ok = binary(R_DIVIDE); break;
+            case OP_LESS: ok = binary(R_LESS); break;
+            case OP_GREATER: ok = binary(R_GREATER); break;
+            case OP_EQUAL: ok = binary(R_EQUAL); break;
+            case OP_LESS_EQUAL: ok = binary(R_LESS_EQUAL); break;
+            case OP_GREATER_EQUAL: ok = binary(R_GREATER_EQUAL); break;
+            case OP_NOT_EQUAL: ok = binary(R_NOT_EQUAL); break;
+            case OP_PRINT:
+                if(!pop(value)) return false;
+                materializeSlots();
+                emit(R_PRINT, 0, value.operand);
+                break;
+            case OP_POP:
+                if(!pop(value)) return false;
+                if(!value.maybeString) break; // numbers and booleans are just dropped
+                materializeAll();
+                emit(R_POP, depth(), value.operand);
+                break;
+            case OP_JUMP_IF_FALSE_TO_LABEL: {
+                Entry check{};
+                if(!pop(value) || !pop(check)) return false;
+                materializeAll();
+                emit(R_JUMP_IF_FALSE_TO_LABEL, depth(), check.operand, value.operand);
+                break;
+            }
+            case OP_JUMP:
+            case OP_JUMP_WIDE:
+            case OP_JUMP_LONG:
+                ok = jump(R_JUMP, chunk.jumpTarget(i));
+                fallsThrough = false;
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_FALSE_WIDE:
+            case OP_JUMP_IF_FALSE_LONG:
+                ok = pop(value) && jump(R_JUMP_IF_FALSE, chunk.jumpTarget(i), value.operand);
+                break;
+            case OP_RETURN:
+            case OP_PART_END:
+                emit(op == OP_RETURN ? R_RETURN : R_PART_END, 0);
+                fallsThrough = false;
+                break;
+            case OP_SET_POINTER: ok = stackInstruction(op, 2, 1, true); break;
+            case OP_SET_POINTER_INVERSE: ok = stackInstruction(op, 2, 1, true); break;
+            case OP_SET_POINTER_WITHOUT_PUSH: ok = stackInstruction(op, 2, 0, false); break;
+            case OP_GET_POINTER: ok = stackInstruction(op, 1, 1, true); break;
+            case OP_EXCHANGE: ok = stackInstruction(op, 2, 1, true); break;
+            case OP_GET_LABEL: ok = stackInstruction(op, 1, 1, false); break;
+            case OP_LOOP_PREPARE:
+            case OP_LOOP_STEP:
+                ok = stackInstruction(op, 0, 1, false, chunk.code[i + 1] << 8 | chunk.code[i + 2]);
+                break;
+            default:
+                return false;
+        }
+        if(!ok) return false;
+    }
+
+    for(auto& jump : jumps){
+        auto target = targetAt.find(jump.second);
+        if(target == targetAt.end()) return false;
+        out.code[jump.first].a = target->second;
+    }
+    return true;
+}
+
+}
+
+bool allocateRegisters(const Chunk& chunk, RegisterCode& registers){
+    return Translation(chunk, registers).run();
+}
@@ -2,41 +2,61 @@
 #include "cstring"
 #include "assert.h"
 #include "../headers/utility.h"
+#include <algorithm>
 #undef EOF
 
-Token replace(const std::vector<ReplaceTokens>& tokens, const Token& t2){
-    for(auto& pair : tokens) {
-        Token t1 = pair.what;
-        if (t1.type != t2.type) continue;
-        if ((t1.type == TokenType::IDENTIFIER || t1.type == TokenType::NUMBER)) {
-            if (t1.length != t2.length) continue;
-            bool matching = true;
-            for (int i = 0; i < t1.length && matching; i++) {
-                if (t1.start[i] != t2.start[i]) matching = false;
-            }
-            if(matching) return pair.with;
-        } else return pair.with;
+const size_t TokenBuffer::NO_LABEL;
+
+void ReplacementTable::add(const ReplaceTokens& replacement){
+    const Token& what = replacement.what;
+    count++;
+    if(what.type == TokenType::IDENTIFIER) identifiers.insert({what, replacement.with});
+    else if(what.type == TokenType::NUMBER) numbers.insert({what, replacement.with});
+    else if(!hasType[(size_t)what.type]) {
+        byType[(size_t)what.type] = replacement.with;
+        hasType[(size_t)what.type] = true;
+    }
+}
+
+const Token& ReplacementTable::replace(const Token& t) const {
+    if(t.type == TokenType::IDENTIFIER || t.type == TokenType::NUMBER) {
+        auto& table = t.type == TokenType::IDENTIFIER ? identifiers : numbers;
+        if(table.empty()) return t;
+        auto found = table.find(t);
+        return found == table.end() ? t : found->second;
     }
-    return t2;
+    return hasType[(size_t)t.type] ? byType[(size_t)t.type] : t;
+}
+
+size_t TokenTextHash::operator()(const Token& token) const {
+    size_t hash = 2166136261u;
+    for(int i = 0; i < token.length; i++) hash = (hash ^ (unsigned char)token.start[i]) * 16777619u;
+    return hash;
+}
+
+bool TokenTextEqual::operator()(const Token& a, const Token& b) const {
+    return a.length == b.length && memcmp(a.start, b.start, a.length) == 0;
 }
 
 Scanner::Scanner(){
     start = nullptr;
     current = nullptr;
+    end = nullptr;
     line = -1;
 }
 
 
 
-void Scanner::init(const char* source){
+void Scanner::init(const char* source, size_t length, int line){
     start = source;
     current = source;
-    line = 1;
+    end = source + length;
+    this->line = line;
 }
 
 
 bool Scanner::isAtEnd(){
-    return *current == '\0';
+    return current == end;
 }
 Token Scanner::makeToken(TokenType type){
     Token t;
@@ -58,12 +78,12 @@ Token Scanner::errorToken(const char* message){
 }
 
 char Scanner::advance(){
-    assert(*current != '\0');
+    assert(current != end);
     return *current++;
 }
 
 bool Scanner::match(char expected){
-    if(*current == expected) {
+    if(!isAtEnd() && *current == expected) {
         advance();
         return true;
     }
@@ -71,11 +91,11 @@ bool Scanner::match(char expected){
 }
 
 char Scanner::peek(){
-    return *current;
+    return isAtEnd() ? '\0' : *current;
 }
 
 char Scanner::peekNext(){
-    if(isAtEnd()) return  '\0';
+    if(isAtEnd() || current + 1 == end) return  '\0';
     return *(current + 1);
 }
 
@@ -147,12 +167,7 @@ Token Scanner::identifier() {
     return makeToken(identifierType());
 }
 
-Token Scanner::scanToken() {
-    Token t = scanTokenInner();
-    if(replacements.empty()) return t;
-    else return replace(replacements, t);
-}
-Token Scanner::scanTokenInner()  {
+Token Scanner::scanToken()  {
     skipWhitespaces();
     start = current;
     if(isAtEnd()) return makeToken(TokenType::EOF);
@@ -196,4 +211,73 @@ Token Scanner::scanTokenInner()  {
         }
     }
     return errorToken("Unexpected token");
-}
\ No newline at end of file
+}
+
+void TokenBuffer::scan(const char* source, size_t length){
+    tokens.clear();
+    labels.clear();
+    lines.clear();
+    in = nullptr;
+    line = 1;
+    append(source, length);
+    tokens.push_back(Token{TokenType::EOF});
+}
+
+void TokenBuffer::stream(FILE* in){
+    tokens.clear();
+    labels.clear();
+    lines.clear();
+    this->in = in;
+    line = 1;
+}
+
+// The tokens of `source` but its EOF, numbered on from the lines before it
+void TokenBuffer::append(const char* source, size_t length){
+    Scanner scanner;
+    scanner.init(source, length, line);
+    for(Token token = scanner.scanToken(); token.type != TokenType::EOF; token = scanner.scanToken()){
+        tokens.push_back(token);
+        size_t i = tokens.size() - 1;
+        if(token.type == TokenType::DOTS_3 && i > 0 && tokens[i - 1].type == TokenType::IDENTIFIER)
+            labels[tokens[i - 1]].push_back(i - 1);
+    }
+    line = scanner.lineNumber();
+}
+
+// Scans the next line of the stream, with the ones a [comment] opened on it runs over; false after the EOF token
+bool TokenBuffer::scanLine(){
+    if(!in) return false;
+    std::string text;
+    char buffer[4096];
+    bool comment = false;
+    while(fgets(buffer, sizeof(buffer), in)){
+        for(const char* c = buffer; *c; c++)
+            if(*c == (comment ? ']' : '[')) comment = !comment;
+        text += buffer;
+        if(text.back() == '\n' && !comment) break;
+    }
+    if(text.empty()) {
+        tokens.push_back(Token{TokenType::EOF});
+        in = nullptr;
+        return true;
+    }
+    lines.push_back(std::move(text));
+    append(lines.back().data(), lines.back().size());
+    return true;
+}
+
+bool TokenBuffer::reach(size_t i){
+    while(i >= tokens.size() && scanLine());
+    return i < tokens.size();
+}
+
+size_t TokenBuffer::findLabel(const Token& name, size_t from, size_t to) {
+    while(true) {
+        auto found = labels.find(name);
+        if(found != labels.end()) {
+            auto at = std::lower_bound(found->second.begin(), found->second.end(), from);
+            if(at != found->second.end()) return *at < to ? *at : NO_LABEL;
+        }
+        if(!scanLine()) return NO_LABEL; // a streamed source may declare it further on
+    }
+}
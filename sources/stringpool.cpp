@@ -0,0 +1,81 @@
+#include <cstring>
+#include "../headers/stringpool.h"
+
+size_t StringPool::KeyHash::operator()(const Key& key) const {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i < key.length; i++){
+        hash ^= (unsigned char)key.start[i];
+        hash *= 1099511628211ull;
+    }
+    return (size_t)hash;
+}
+
+bool StringPool::KeyEqual::operator()(const Key& a, const Key& b) const {
+    return a.length == b.length && memcmp(a.start, b.start, a.length) == 0;
+}
+
+char* StringPool::allocate(size_t size) {
+    if(size > BLOCK_SIZE / 4){ // long strings get a block of their own
+        char* block = new char[size];
+        blocks.insert(blocks.end() - (blocks.empty() ? 0 : 1), block);
+        return block;
+    }
+    if(blockUsed + size > BLOCK_SIZE){
+        blocks.push_back(new char[BLOCK_SIZE]);
+        blockUsed = 0;
+    }
+    char* memory = blocks.back() + blockUsed;
+    blockUsed += size;
+    return memory;
+}
+
+const char* StringPool::intern(const char* start, size_t length) {
+    auto found = table.find({start, length});
+    if(found != table.end()) return byId[found->second];
+
+    // the slot, then the id, then the characters
+    uint32_t id = byId.size();
+    char* memory = allocate(2 * sizeof(uint32_t) + length + 1);
+    memcpy(memory, &NO_SLOT, sizeof(uint32_t));
+    memcpy(memory + sizeof(uint32_t), &id, sizeof(uint32_t));
+    char* str = memory + 2 * sizeof(uint32_t);
+    memcpy(str, start, length);
+    str[length] = '\0';
+
+    table.emplace(Key{str, length}, id);
+    byId.push_back(str);
+    return str;
+}
+
+uint32_t StringPool::idOf(const char* interned) {
+    uint32_t id;
+    memcpy(&id, interned - sizeof(uint32_t), sizeof(uint32_t));
+    return id;
+}
+
+const uint32_t StringPool::NO_SLOT;
+
+uint32_t StringPool::addSlot(const char* interned) {
+    uint32_t slot = slotOf(interned);
+    if(slot != NO_SLOT) return slot;
+    slot = bySlot.size();
+    memcpy(const_cast<char*>(interned) - 2 * sizeof(uint32_t), &slot, sizeof(uint32_t)); // the pool's own block
+    bySlot.push_back(interned);
+    return slot;
+}
+
+uint32_t StringPool::slotOf(const char* interned) {
+    uint32_t slot;
+    memcpy(&slot, interned - 2 * sizeof(uint32_t), sizeof(uint32_t));
+    return slot;
+}
+
+void StringPool::clear() {
+    for(char* block : blocks) delete[] block;
+    blocks.clear();
+    table.clear();
+    byId.clear();
+    bySlot.clear();
+    blockUsed = BLOCK_SIZE;
+}
@@ -0,0 +1,71 @@
+#include "../headers/threadpool.h"
+
+ThreadPool::ThreadPool(size_t threads){
+    if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for(size_t i = 0; i < threads; i++) queues.emplace_back(new Queue());
+    for(size_t i = 0; i < threads; i++) workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(auto& worker : workers) worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Queue& queue = *queues[next++ % queues.size()];
+        std::lock_guard<std::mutex> queueGuard(queue.lock);
+        queue.tasks.push_back(std::move(task));
+        queued++;
+        pending++;
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::wait(){
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this]{ return pending == 0; });
+}
+
+// Own tasks newest first, then the oldest task of the others
+bool ThreadPool::take(size_t self, std::function<void()>& task){
+    for(size_t i = 0; i < queues.size(); i++){
+        Queue& queue = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> queueGuard(queue.lock);
+        if(queue.tasks.empty()) continue;
+        if(i == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::work(size_t self){
+    std::function<void()> task;
+    while(true){
+        if(take(self, task)) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                queued--;
+            }
+            task();
+            task = nullptr;
+            std::lock_guard<std::mutex> guard(lock);
+            if(--pending == 0) idle.notify_all();
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this]{ return stopping || queued > 0; });
+        if(stopping && queued == 0) return;
+    }
+}
@@ -1,32 +1,120 @@
+#include <algorithm>
 #include <cstdarg>
 #include <cstdio>
+#include <cstdlib>
 #include <cassert>
+#include <cmath>
 #include "../headers/vm.h"
 #include "../headers/debug.h"
+#include "../headers/optimizer.h"
 #include "../headers/utility.h"
 
+// THREADED_DISPATCH (cmake -DTHREADED_DISPATCH=ON) jumps straight from one instruction to the next
+// through a table of label addresses, a GCC/Clang extension; other compilers get the switch.
+#if defined(THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+
 void Vm::initVM() {
     stackCount = 0;
 }
 
 void Vm::freeVM() {
-    freeStrings();
+    pMap.clear();
+    memory.clear();
+    addresses.clear();
+    aliasedAddresses = false;
+    compileCache.clear();
+}
+
+void Vm::setProfiler(Profiler* profiler) {
+    this->profiler = profiler;
+}
+
+void Vm::setOptimize(bool optimize) {
+    optimizeCode = optimize;
+}
+
+void Vm::setBackend(Backend backend) {
+    this->backend = backend;
+}
+
+void Vm::setOutput(FILE* out, FILE* errors) {
+    this->out = out;
+    this->errors = errors;
+    p.errors = errors;
+}
+
+void Vm::setDisassemble(bool disassemble) {
+    this->disassemble = disassemble;
+}
+
+void Vm::setThreads(size_t threads) {
+    this->threads = threads;
+    pool.reset();
+}
+
+void Vm::setMemoryLimit(size_t cells) {
+    memory.setLimit(cells);
+}
+
+void Vm::setCompileCacheLimits(size_t entries, size_t bytes) {
+    compileCache.setLimits(entries, bytes);
+}
+
+void Vm::setCompileCacheDirectory(const std::string& directory) {
+    compileCache.setDirectory(directory);
+}
+
+CompileCacheStats Vm::compileCacheStats() const {
+    return compileCache.stats();
+}
+
+ExpansionStats Vm::expansionStats() const {
+    return compiler.expansionStats();
+}
+
+MemoryStats Vm::memoryStats() const {
+    MemoryStats stats{};
+    stats.cells = memory.size();
+    stats.blocks = memory.blockCount();
+    stats.pages = addresses.pageCount();
+    stats.bytes = (stats.blocks * CellArena::BLOCK_SIZE + stats.pages * AddressSpace::PAGE_SIZE) * sizeof(Value);
+    stats.cellLimit = memory.getLimit();
+    return stats;
 }
 
 void Vm::runtimeError(const char* format, ...){
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(errors, format, args);
     va_end(args);
-    fputc('\n', stderr);
+    fputc('\n', errors);
 
-    size_t instruction = ip  - 1;
-    int line = chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script \n", line);
+    if(ip > 0) { // not before the first instruction
+        size_t instruction = ip  - 1;
+        int line = chunk->lineAt(instruction);
+        fprintf(errors, "[line %d] in script \n", line);
+    }
     stackCount = 0;
     programFinished = true;
 }
 
+// The chunk's maxStack is checked against the room left once before it runs and at every jump to a label
+// computed at runtime, the only way to enter its code with more values below, so push() and pop() need no checks.
+bool Vm::stackFits() {
+    if(chunk->maxStack == Chunk::UNBOUNDED_STACK) {
+        runtimeError("The stack grows on every pass of a loop.");
+        return false;
+    }
+    if(stackCount + chunk->maxStack <= STACK_MAX) return true;
+    runtimeError("Stack overflow: %zu values are on the stack and the program pushes up to %u more, "
+                 "the stack holds %d.", stackCount, chunk->maxStack, STACK_MAX);
+    return false;
+}
+
 void Vm::push(const Value value) {
     stack[stackCount++] = value;
 }
@@ -40,21 +128,80 @@ Value Vm::peek(size_t distance){
 }
 
 byte Vm::readByte() {
-    return chunk->code[ip++];
+    return code[ip++];
+}
+
+uint16_t Vm::readShort() {
+    ip += 2;
+    return (uint16_t)(code[ip - 2] << 8 | code[ip - 1]);
+}
+
+uint32_t Vm::readLong() {
+    uint32_t high = readShort();
+    return high << 16 | readShort();
 }
 Value* Vm::addToMemory(const Value& value){
-    memory[memorySize++] = value;
-    return &memory[memorySize-1];
+    Value* cell = memory.allocate(value);
+    if(cell == nullptr) runtimeError("Out of memory: more than %zu cells.", memory.getLimit());
+    return cell;
 }
 
-Value* Vm::stringToPointer(std::string s){
-    if(has(pMap, s)) return pMap[s];
-    else return nullptr;
+// A name without a slot, like a label made a cell at runtime, keeps its cell in pMap
+Value* Vm::stringToPointer(const char* name){
+    uint32_t slot = StringPool::slotOf(name);
+    if(slot != StringPool::NO_SLOT) return slots[slot];
+    auto cell = pMap.find(name);
+    return cell == pMap.end() ? nullptr : cell->second;
 }
 
-InterpretResult Vm::run() {
+Value*& Vm::cellFor(const char* name){
+    uint32_t slot = StringPool::slotOf(name);
+    if(slot != StringPool::NO_SLOT) return slots[slot];
+    return pMap[name];
+}
+
+void Vm::bindSlots(){
+    slots.assign(chunk->strings.slotCount(), nullptr);
+    for(size_t i = 0; i < slots.size(); i++){
+        auto cell = pMap.find(chunk->strings.atSlot(i));
+        if(cell != pMap.end()) slots[i] = cell->second;
+    }
+}
+
+void Vm::unbindSlots(){
+    for(size_t i = 0; i < slots.size(); i++)
+        if(slots[i]) pMap[chunk->strings.atSlot(i)] = slots[i];
+    slots.clear();
+}
+
+// Sum of OP_ADD: numbers, or a pointer moved by a number. Names stand for their cell.
+inline bool Vm::add(Value a, Value b, Value& sum){
+    if(a.type() == ValueType::STRING){
+        Value* t = stringToPointer(a.string());
+        if(t) a = *t;
+    }
+    if(b.type() == ValueType::STRING){
+        Value* t = stringToPointer(b.string());
+        if(t) b = *t;
+    }
+    if(a.type() == ValueType::NUMBER && b.type() == ValueType::NUMBER){
+        sum = Value(a.number() + b.number());
+    }
+    else if(a.type() == ValueType::POINTER && b.type() == ValueType::NUMBER){
+        sum = Value(a.pointTo() + (int)b.number());
+    } else if(a.type() == ValueType::NUMBER && b.type() == ValueType::POINTER){
+        Value* t = (Value* )b.pointTo() + (int)a.number();
+        sum = Value(t);
+    } else return false;
+    return true;
+}
+
+// PROFILING reports every instruction to `profiler` before it runs; run() only takes that instantiation
+// when there is one, the other compiles to the plain loop.
+template<bool PROFILING>
+InterpretResult Vm::execute() {
 #define CHECK_NEXT_NUMBER(pos) \
-    if(peek(pos).type != ValueType::NUMBER){   \
+    if(peek(pos).type() != ValueType::NUMBER){   \
         runtimeError("Expected number.");      \
         return InterpretResult::RUNTIME_ERROR; \
     }                      \
@@ -63,176 +210,550 @@ InterpretResult Vm::run() {
     do {                         \
                 CHECK_NEXT_NUMBER(0);        \
                 CHECK_NEXT_NUMBER(1);        \
-                double b = pop().val.number;  \
-                double a = pop().val.number;  \
+                double b = pop().number();  \
+                double a = pop().number();  \
                 push(Value(a op b));         \
     } while(false)
 
-    for(ip = 0; ip < chunk->count() - 0 && !programFinished; ){
+#define NEGATED_BINARY_OP(op) \
+    do {                         \
+                CHECK_NEXT_NUMBER(0);        \
+                CHECK_NEXT_NUMBER(1);        \
+                double b = pop().number();  \
+                double a = pop().number();  \
+                push(Value(!(a op b)));      \
+    } while(false)
 
-        switch (readByte()) {
-            case OP_RETURN:
-                programFinished = true;
-                return InterpretResult::OK;
-            case OP_PRINT:
-            {
-                Value v =  pop();
-                if(v.type == ValueType::STRING && has(pMap, v.val.string))
-                    pMap[v.val.string]->printValue();
-                else v.printValue();  printf("\n"); break;
+#if COMPUTED_GOTO
+    // one entry per OpCode, in declaration order
+    static const void* dispatchTable[] = {
+        &&OP_RETURN_, &&OP_CONSTANT_, &&OP_NEGATE_, &&OP_ADD_, &&OP_SUBTRACT_, &&OP_MULTIPLY_,
+        &&OP_DIVIDE_, &&OP_NOT_, &&OP_LESS_, &&OP_EQUAL_, &&OP_GREATER_, &&OP_TRUE_, &&OP_FALSE_,
+        &&OP_PRINT_, &&OP_POP_, &&OP_SET_POINTER_, &&OP_SET_POINTER_WITHOUT_PUSH_, &&OP_GET_POINTER_,
+        &&OP_SET_POINTER_INVERSE_, &&OP_PART_END_, &&OP_JUMP_IF_FALSE_, &&OP_JUMP_, &&OP_EXCHANGE_,
+        &&OP_JUMP_IF_FALSE_TO_LABEL_, &&OP_GET_LABEL_, &&OP_JUMP_WIDE_, &&OP_JUMP_IF_FALSE_WIDE_,
+        &&OP_GET_SLOT_, &&OP_SET_SLOT_, &&OP_CONSTANT_LONG_, &&OP_JUMP_LONG_, &&OP_JUMP_IF_FALSE_LONG_,
+        &&OP_LESS_EQUAL_, &&OP_GREATER_EQUAL_, &&OP_NOT_EQUAL_, &&OP_LOOP_PREPARE_, &&OP_LOOP_STEP_
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(*dispatchTable) == OP_LOOP_STEP + 1,
+                  "dispatchTable is out of sync with OpCode");
+#define CASE(op) op##_
+#define NEXT do { if(PROFILING) profiler->enter(ip); goto *dispatchTable[readByte()]; } while(false)
+#define DISPATCH NEXT;
+#else
+#define CASE(op) case op
+#define NEXT goto dispatch
+#define DISPATCH dispatch: if(PROFILING) profiler->enter(ip); switch (readByte())
+#endif
+
+    // Every chunk ends with OP_RETURN and jump targets are checked, so the loop needs no bounds test.
+    DISPATCH
+    {
+        CASE(OP_RETURN):
+            programFinished = true;
+            return InterpretResult::OK;
+        CASE(OP_PRINT):
+        {
+            Value v =  pop();
+            Value* cell = v.type() == ValueType::STRING ? stringToPointer(v.string()) : nullptr;
+            if(cell)
+                cell->printValue(out);
+            else v.printValue(out);
+            fputc('\n', out);
+            NEXT;
+        }
+        CASE(OP_JUMP_IF_FALSE):
+        {
+            byte skipNext =  readByte();
+            if(isFalsey(pop())) ip += skipNext;
+            NEXT;
+        }
+        CASE(OP_JUMP): {
+            byte skipNext =  readByte();
+            ip += skipNext;
+            NEXT;
+        }
+        CASE(OP_EXCHANGE):
+            if(exchange() == InterpretResult::RUNTIME_ERROR) {
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            NEXT;
+        CASE(OP_POP):
+        {
+            Value v = pop();
+            if(v.type() != ValueType::STRING) NEXT; // labels are identifiers, a number never names one
+            size_t target;
+            if(labelTarget(v.string(), target) == InterpretResult::RUNTIME_ERROR)
+                return InterpretResult::RUNTIME_ERROR;
+            if(target != NO_JUMP) {
+                ip = target;
+                if(!stackFits()) return InterpretResult::RUNTIME_ERROR;
             }
-            case OP_JUMP_IF_FALSE:
+            NEXT;
+        }
+
+        CASE(OP_JUMP_IF_FALSE_TO_LABEL): {
+            Value v = pop();
+            Value check = pop();
+            if(isFalsey(check))
             {
-                byte skipNext =  readByte();
-                if(isFalsey(pop())) ip += skipNext;
-                break;
+                size_t target;
+                if(!declaredLabel(v, target)) return InterpretResult::RUNTIME_ERROR;
+                ip = target;
+                if(!stackFits()) return InterpretResult::RUNTIME_ERROR;
             }
-            case OP_JUMP: {
-                byte skipNext =  readByte();
-                ip += skipNext;
-                break;
+            NEXT;
+        }
+        CASE(OP_JUMP_WIDE): {
+            int16_t distance = readShort();
+            ip += distance;
+            NEXT;
+        }
+        CASE(OP_JUMP_IF_FALSE_WIDE): {
+            int16_t distance = readShort();
+            if(isFalsey(pop())) ip += distance;
+            NEXT;
+        }
+        CASE(OP_JUMP_LONG): {
+            int32_t distance = readLong();
+            ip += distance;
+            NEXT;
+        }
+        CASE(OP_JUMP_IF_FALSE_LONG): {
+            int32_t distance = readLong();
+            if(isFalsey(pop())) ip += distance;
+            NEXT;
+        }
+        CASE(OP_GET_SLOT): {
+            uint16_t slot = readShort();
+            if(slots[slot] == nullptr || slots[slot]->pointTo() == nullptr) {
+                runtimeError("Undefined pointTo %s", chunk->strings.atSlot(slot));
+                return InterpretResult::RUNTIME_ERROR;
             }
-            case OP_EXCHANGE: {
-                Value a = pop();
-                Value b = pop();
-                if(a.type == ValueType::STRING){
-                    Value* t = stringToPointer(a.val.string);
-                    if(t) a = *t;
-                }
-                if(b.type == ValueType::STRING){
-                    Value* t = stringToPointer(b.val.string);
-                    if(t) b = *t;
-                }
-                if(a.type != ValueType::POINTER || b.type != ValueType::POINTER)
-                {
-                    runtimeError("Expected 2 pointers to exchange their values");
-                    return InterpretResult::RUNTIME_ERROR;
-                }
-                Value temp = *b.val.pointTo;
-                *b.val.pointTo = *a.val.pointTo;
-                *a.val.pointTo = temp;
-                push(b);
-                break;
+            push(*slots[slot]->pointTo());
+            NEXT;
+        }
+        CASE(OP_SET_SLOT): { // same as OP_SET_POINTER, the assigned value stays on the stack
+            uint16_t slot = readShort();
+            if(slots[slot] == nullptr && (slots[slot] = addToMemory(Value())) == nullptr)
+                return InterpretResult::RUNTIME_ERROR;
+            if(pointTo(slots[slot], peek(0)) == InterpretResult::RUNTIME_ERROR)
+                return InterpretResult::RUNTIME_ERROR;
+            NEXT;
+        }
+        CASE(OP_GET_LABEL):
+            if(getLabel() == InterpretResult::RUNTIME_ERROR) {
+                return InterpretResult::RUNTIME_ERROR;
             }
-            case OP_POP:
-            {
-                Value v = pop();
-                std::string label;
-                if(v.type == ValueType::NUMBER) label = std::to_string(v.val.number);
-                else if(v.type == ValueType::STRING) label = v.val.string;
-                else break;
-                if(has(chunk->labelMap, label) ) ip = chunk->labelMap[label];
-                else if(has(pMap, label) && pMap[label]->val.pointTo->type == ValueType::NUMBER) ip = pMap[label]->val.pointTo->val.number;
-                break;
+            NEXT;
+        CASE(OP_SET_POINTER):
+            if(setPointer(false, true) == InterpretResult::RUNTIME_ERROR) {
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            NEXT;
+        CASE(OP_SET_POINTER_WITHOUT_PUSH):
+            if(setPointer(false, false) == InterpretResult::RUNTIME_ERROR) {
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            NEXT;
+        CASE(OP_GET_POINTER):
+            if(getPointer() == InterpretResult::RUNTIME_ERROR) {
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            NEXT;
+        CASE(OP_SET_POINTER_INVERSE):
+            if(setPointer(true, true) == InterpretResult::RUNTIME_ERROR) {
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            NEXT;
+        CASE(OP_CONSTANT):
+            push(constants[readByte()]); NEXT;
+        CASE(OP_CONSTANT_LONG): {
+            uint32_t index = readByte() << 16;
+            index |= readShort();
+            push(constants[index]);
+            NEXT;
+        }
+        CASE(OP_TRUE):
+            push(Value(true)); NEXT;
+        CASE(OP_FALSE):
+            push(Value(false)); NEXT;
+        CASE(OP_NEGATE):
+            CHECK_NEXT_NUMBER(0);
+            push(Value(-(pop()).number()));
+            NEXT;
+        CASE(OP_NOT):
+            push(Value(isFalsey(pop()))  ); NEXT;
+        CASE(OP_ADD):
+        {
+            Value a = pop();
+            Value b = pop();
+            Value sum;
+            if(add(a, b, sum)) push(sum);
+            NEXT;
+        }
+        CASE(OP_SUBTRACT):
+            BINARY_OP(-); NEXT;
+        CASE(OP_MULTIPLY):
+            BINARY_OP(*); NEXT;
+        CASE(OP_DIVIDE):
+            BINARY_OP(/); NEXT;
+        CASE(OP_LESS):
+            BINARY_OP(<); NEXT;
+        CASE(OP_GREATER):
+            BINARY_OP(>); NEXT;
+        CASE(OP_EQUAL):
+        {
+            Value b = pop();
+            Value a = pop();
+            push(Value(a == b));
+            NEXT;
+        }
+        // negated like the OP_GREATER, OP_NOT pair they replace, so NaN compares the same way
+        CASE(OP_LESS_EQUAL):
+            NEGATED_BINARY_OP(>); NEXT;
+        CASE(OP_GREATER_EQUAL):
+            NEGATED_BINARY_OP(<); NEXT;
+        CASE(OP_NOT_EQUAL):
+        {
+            Value b = pop();
+            Value a = pop();
+            push(Value(!(a == b)));
+            NEXT;
+        }
+        CASE(OP_LOOP_PREPARE): {
+            uint16_t loop = readShort();
+            if(loopPrepare(loop) == InterpretResult::RUNTIME_ERROR)
+                return InterpretResult::RUNTIME_ERROR;
+            if(!isFalsey(peek(0)) && runParallel(loop, ip - 3)) { // every iteration ran, the step ends the loop
+                pop();
+                ip = parallelLoops[loop].step;
             }
+            NEXT;
+        }
+        CASE(OP_LOOP_STEP):
+            if(loopStep(readShort()) == InterpretResult::RUNTIME_ERROR) {
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            NEXT;
+        CASE(OP_PART_END): return InterpretResult::OK;
+#if !COMPUTED_GOTO
+        default:
+            assert(false);
+            return InterpretResult::RUNTIME_ERROR;
+#endif
+    }
+#undef CASE
+#undef NEXT
+#undef DISPATCH
+}
 
-            case OP_JUMP_IF_FALSE_TO_LABEL: {
-                Value v = pop();
-                Value check = pop();
-                std::string label;
-                if(v.type == ValueType::NUMBER) label = std::to_string(v.val.number);
-                else if(v.type == ValueType::STRING) label = v.val.string;
+InterpretResult Vm::run() {
+    return profiler ? execute<true>() : execute<false>();
+}
 
+const Value* Vm::operand(uint32_t operand){
+    uint32_t index = operand & ~OPERAND_KIND;
+    switch (operand & OPERAND_KIND) {
+        case OPERAND_REGISTER: return &stack[index];
+        case OPERAND_CONSTANT: return &registers->constants[index];
+        default:
+            if(slots[index] == nullptr || slots[index]->pointTo() == nullptr) {
+                runtimeError("Undefined pointTo %s", chunk->strings.atSlot(index));
+                return nullptr;
+            }
+            return slots[index]->pointTo();
+    }
+}
 
-                if(isFalsey(check))
-                {
-                    if(!has(chunk->labelMap, label)) {
-                        return InterpretResult::RUNTIME_ERROR;
-                    }
-                    ip = chunk->labelMap[label];
-                }
-                break;
+// Instructions without a register form run as on the stack VM, over the registers below the depth
+InterpretResult Vm::runStackInstruction(const RegisterInstruction& instruction){
+    stackCount = instruction.b;
+    switch (instruction.a) {
+        case OP_SET_POINTER: return setPointer(false, true);
+        case OP_SET_POINTER_WITHOUT_PUSH: return setPointer(false, false);
+        case OP_SET_POINTER_INVERSE: return setPointer(true, true);
+        case OP_GET_POINTER: return getPointer();
+        case OP_EXCHANGE: return exchange();
+        case OP_GET_LABEL: return getLabel();
+        case OP_LOOP_PREPARE: return loopPrepare(instruction.c);
+        case OP_LOOP_STEP: return loopStep(instruction.c);
+        default:
+            assert(false);
+            return InterpretResult::RUNTIME_ERROR;
+    }
+}
+
+InterpretResult Vm::runRegisters() {
+// A label jump lands on a statement of the register code, anywhere else the stack VM
+// takes over from that offset with the registers as its stack.
+#define JUMP_TO_LABEL(target, depth) do { \
+    if((depth) == 0 && registers->entries[target] != RegisterCode::NO_ENTRY) pc = registers->entries[target]; \
+    else {                       \
+        stackCount = (depth);    \
+        ip = (target);           \
+        if(!stackFits()) return InterpretResult::RUNTIME_ERROR; \
+        return run();            \
+    }                            \
+} while(false)
+
+#define READ(value, from) \
+    const Value* value = operand(from); \
+    if(value == nullptr) return InterpretResult::RUNTIME_ERROR;
+
+#define REGISTER_BINARY_OP(op) \
+    do {                         \
+                READ(a, instruction.b);      \
+                READ(b, instruction.c);      \
+                if(a->type() != ValueType::NUMBER || b->type() != ValueType::NUMBER){ \
+                    runtimeError("Expected number.");      \
+                    return InterpretResult::RUNTIME_ERROR; \
+                }                            \
+                stack[instruction.a] = Value(a->number() op b->number()); \
+    } while(false)
+
+#define NEGATED_REGISTER_BINARY_OP(op) \
+    do {                         \
+                READ(a, instruction.b);      \
+                READ(b, instruction.c);      \
+                if(a->type() != ValueType::NUMBER || b->type() != ValueType::NUMBER){ \
+                    runtimeError("Expected number.");      \
+                    return InterpretResult::RUNTIME_ERROR; \
+                }                            \
+                stack[instruction.a] = Value(!(a->number() op b->number())); \
+    } while(false)
+
+#if COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        &&R_MOVE_, &&R_NEGATE_, &&R_NOT_, &&R_ADD_, &&R_SUBTRACT_, &&R_MULTIPLY_, &&R_DIVIDE_,
+        &&R_LESS_, &&R_GREATER_, &&R_EQUAL_, &&R_LESS_EQUAL_, &&R_GREATER_EQUAL_, &&R_NOT_EQUAL_,
+        &&R_SET_SLOT_, &&R_PRINT_, &&R_POP_, &&R_JUMP_, &&R_JUMP_IF_FALSE_, &&R_JUMP_IF_FALSE_TO_LABEL_,
+        &&R_STACK_, &&R_RETURN_, &&R_PART_END_
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(*dispatchTable) == R_PART_END + 1,
+                  "dispatchTable is out of sync with RegisterOp");
+#define CASE(op) op##_
+#define NEXT goto dispatch
+#define DISPATCH dispatch: instruction = code[pc++]; ip = instruction.origin + 1; goto *dispatchTable[instruction.op];
+#else
+#define CASE(op) case op
+#define NEXT goto dispatch
+#define DISPATCH dispatch: instruction = code[pc++]; ip = instruction.origin + 1; switch (instruction.op)
+#endif
+
+    const RegisterInstruction* code = registers->code.data();
+    RegisterInstruction instruction{};
+    size_t pc = 0;
+    DISPATCH
+    {
+        CASE(R_MOVE): {
+            READ(value, instruction.b);
+            stack[instruction.a] = *value;
+            NEXT;
+        }
+        CASE(R_NEGATE): {
+            READ(value, instruction.b);
+            if(value->type() != ValueType::NUMBER){
+                runtimeError("Expected number.");
+                return InterpretResult::RUNTIME_ERROR;
             }
-            case OP_GET_LABEL: {
-                Value v = pop();
-                if(v.type != ValueType::STRING){ runtimeError("Expected label got %s", std::string(v).c_str()); return InterpretResult::RUNTIME_ERROR;}
-                if(!has(chunk->labelMap, v.val.string)){ runtimeError("No such label %s", v.val.string); return InterpretResult::RUNTIME_ERROR;}
-                push(Value((double)chunk->labelMap[v.val.string]));
-                break;
+            stack[instruction.a] = Value(-value->number());
+            NEXT;
+        }
+        CASE(R_NOT): {
+            READ(value, instruction.b);
+            stack[instruction.a] = Value(isFalsey(*value));
+            NEXT;
+        }
+        CASE(R_ADD): {
+            READ(a, instruction.b);
+            READ(b, instruction.c);
+            Value sum;
+            if(!add(*b, *a, sum)){ // the stack VM drops both and goes on a value short
+                runtimeError("Expected two numbers, or a pointer and a number.");
+                return InterpretResult::RUNTIME_ERROR;
             }
-            case OP_SET_POINTER:
-                if(setPointer(false, true) == InterpretResult::RUNTIME_ERROR)
-                    return InterpretResult::RUNTIME_ERROR; break;
-            case OP_SET_POINTER_WITHOUT_PUSH:
-                if(setPointer(false, false) == InterpretResult::RUNTIME_ERROR)
-                    return InterpretResult::RUNTIME_ERROR; break;
-            case OP_GET_POINTER:
-                if(getPointer() == InterpretResult::RUNTIME_ERROR)
-                    return InterpretResult::RUNTIME_ERROR; break;
-            case OP_SET_POINTER_INVERSE:
-                if(setPointer(true, true) == InterpretResult::RUNTIME_ERROR)
-                    return InterpretResult::RUNTIME_ERROR; break;
-            case OP_CONSTANT:
-                push(chunk->constants[readByte()]); break;
-            case OP_TRUE:
-                push(Value(true)); break;
-            case OP_FALSE:
-                push(Value(false)); break;
-            case OP_NEGATE:
-                CHECK_NEXT_NUMBER(0);
-                push(Value(-(pop()).val.number));
-                break;
-            case OP_NOT:
-                push(Value(isFalsey(pop()))  ); break;
-            case OP_ADD:
-            {
-                Value a = pop();
-                Value b = pop();
-                if(a.type == ValueType::STRING){
-                    Value* t = stringToPointer(a.val.string);
-                    if(t) a = *t;
-                }
-                if(b.type == ValueType::STRING){
-                    Value* t = stringToPointer(b.val.string);
-                    if(t) b = *t;
-                }
-                if(a.type == ValueType::NUMBER && b.type == ValueType::NUMBER){
-                    push(Value(a.val.number + b.val.number));
-                }
-                else if(a.type == ValueType::POINTER && b.type == ValueType::NUMBER){
-                    push(Value(a.val.pointTo + (int)b.val.number));
-                } else if(a.type == ValueType::NUMBER && b.type == ValueType::POINTER){
-                    Value* t = (Value* )b.val.pointTo + (int)a.val.number;
-                    push(Value(t));
-                }
-                break;
+            stack[instruction.a] = sum;
+            NEXT;
+        }
+        CASE(R_SUBTRACT):
+            REGISTER_BINARY_OP(-); NEXT;
+        CASE(R_MULTIPLY):
+            REGISTER_BINARY_OP(*); NEXT;
+        CASE(R_DIVIDE):
+            REGISTER_BINARY_OP(/); NEXT;
+        CASE(R_LESS):
+            REGISTER_BINARY_OP(<); NEXT;
+        CASE(R_GREATER):
+            REGISTER_BINARY_OP(>); NEXT;
+        CASE(R_LESS_EQUAL):
+            NEGATED_REGISTER_BINARY_OP(>); NEXT;
+        CASE(R_GREATER_EQUAL):
+            NEGATED_REGISTER_BINARY_OP(<); NEXT;
+        CASE(R_EQUAL): {
+            READ(a, instruction.b);
+            READ(b, instruction.c);
+            stack[instruction.a] = Value(*a == *b);
+            NEXT;
+        }
+        CASE(R_NOT_EQUAL): {
+            READ(a, instruction.b);
+            READ(b, instruction.c);
+            stack[instruction.a] = Value(!(*a == *b));
+            NEXT;
+        }
+        CASE(R_SET_SLOT): {
+            READ(value, instruction.b);
+            if(slots[instruction.a] == nullptr && (slots[instruction.a] = addToMemory(Value())) == nullptr)
+                return InterpretResult::RUNTIME_ERROR;
+            if(pointTo(slots[instruction.a], *value) == InterpretResult::RUNTIME_ERROR)
+                return InterpretResult::RUNTIME_ERROR;
+            NEXT;
+        }
+        CASE(R_PRINT): {
+            READ(value, instruction.b);
+            Value* cell = value->type() == ValueType::STRING ? stringToPointer(value->string()) : nullptr;
+            if(cell)
+                cell->printValue(out);
+            else value->printValue(out);
+            fputc('\n', out);
+            NEXT;
+        }
+        CASE(R_POP): {
+            READ(value, instruction.b);
+            if(value->type() != ValueType::STRING) NEXT;
+            size_t target;
+            if(labelTarget(value->string(), target) == InterpretResult::RUNTIME_ERROR)
+                return InterpretResult::RUNTIME_ERROR;
+            if(target != NO_JUMP) JUMP_TO_LABEL(target, instruction.a);
+            NEXT;
+        }
+        CASE(R_JUMP):
+            pc = instruction.a; NEXT;
+        CASE(R_JUMP_IF_FALSE): {
+            READ(value, instruction.b);
+            if(isFalsey(*value)) pc = instruction.a;
+            NEXT;
+        }
+        CASE(R_JUMP_IF_FALSE_TO_LABEL): {
+            READ(check, instruction.b);
+            READ(label, instruction.c);
+            if(isFalsey(*check)) {
+                size_t target;
+                if(!declaredLabel(*label, target)) return InterpretResult::RUNTIME_ERROR;
+                JUMP_TO_LABEL(target, instruction.a);
             }
-            case OP_SUBTRACT:
-                BINARY_OP(-); break;
-            case OP_MULTIPLY:
-                BINARY_OP(*); break;
-            case OP_DIVIDE:
-                BINARY_OP(/); break;
-            case OP_LESS:
-                BINARY_OP(<); break;
-            case OP_GREATER:
-                BINARY_OP(>); break;
-            case OP_EQUAL:
-            {
-                Value b = pop();
-                Value a = pop();
-                push(Value(a == b));
-                break;
+            NEXT;
+        }
+        CASE(R_STACK):
+            if(runStackInstruction(instruction) == InterpretResult::RUNTIME_ERROR)
+                return InterpretResult::RUNTIME_ERROR;
+            if(instruction.a == OP_LOOP_PREPARE && !isFalsey(stack[instruction.b]) &&
+               runParallel(instruction.c, instruction.origin)) {
+                JUMP_TO_LABEL(parallelLoops[instruction.c].step, instruction.b);
             }
-            case OP_PART_END: return InterpretResult::OK;
-            default:
-                assert(false);
+            NEXT;
+        CASE(R_RETURN):
+            programFinished = true;
+            return InterpretResult::OK;
+        CASE(R_PART_END): return InterpretResult::OK;
+#if !COMPUTED_GOTO
+        default:
+            assert(false);
+            return InterpretResult::RUNTIME_ERROR;
+#endif
+    }
+#undef CASE
+#undef NEXT
+#undef DISPATCH
+#undef READ
+#undef JUMP_TO_LABEL
+}
+
+InterpretResult Vm::exchange(){
+    Value a = pop();
+    Value b = pop();
+    if(a.type() == ValueType::STRING){
+        Value* t = stringToPointer(a.string());
+        if(t) a = *t;
+    }
+    if(b.type() == ValueType::STRING){
+        Value* t = stringToPointer(b.string());
+        if(t) b = *t;
+    }
+    if(a.type() != ValueType::POINTER || b.type() != ValueType::POINTER)
+    {
+        runtimeError("Expected 2 pointers to exchange their values");
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    Value temp = *b.pointTo();
+    *b.pointTo() = *a.pointTo();
+    *a.pointTo() = temp;
+    push(b);
+    return InterpretResult::OK;
+}
+
+InterpretResult Vm::getLabel(){
+    Value v = pop();
+    if(v.type() != ValueType::STRING){ runtimeError("Expected label got %s", std::string(v).c_str()); return InterpretResult::RUNTIME_ERROR;}
+    if(!has(chunk->labelMap, v.string())){ runtimeError("No such label %s", v.string()); return InterpretResult::RUNTIME_ERROR;}
+    push(Value((double)chunk->labelMap[v.string()]));
+    return InterpretResult::OK;
+}
+
+// Where a jump to `name` goes: a declared label, or the offset kept in the cell `name`.
+// NO_JUMP when it is neither. The offset has to be one OP_GET_LABEL gives, the start or a label:
+// stackFits() only covers code entered there, anywhere else could be inside an instruction.
+// A cell holding any other number, like the 1 of "'a = 1; 'b = a", is a value and not a label,
+// so dropping its name goes on with the next instruction.
+InterpretResult Vm::labelTarget(const char* name, size_t& target){
+    target = NO_JUMP;
+    std::string label = name;
+    if(has(chunk->labelMap, label) ) target = chunk->labelMap[label];
+    else {
+        Value* cell = stringToPointer(name);
+        if(cell && cell->pointTo() && cell->pointTo()->type() == ValueType::NUMBER) {
+            double offset = cell->pointTo()->number();
+            if(offset >= 0 && offset < chunk->count() && offset == (size_t)offset &&
+               chunk->isEntryPoint((size_t)offset))
+                target = offset;
         }
     }
-    runtimeError("No return statement");
-    return InterpretResult::RUNTIME_ERROR;
+    return InterpretResult::OK;
+}
+
+// Label of OP_JUMP_IF_FALSE_TO_LABEL, only declared ones count
+bool Vm::declaredLabel(const Value& v, size_t& target){
+    std::string label;
+    if(v.type() == ValueType::NUMBER) label = std::to_string(v.number());
+    else if(v.type() == ValueType::STRING) label = v.string();
+    if(!has(chunk->labelMap, label)) return false;
+    target = chunk->labelMap[label];
+    return true;
+}
+
+// NaN has no place among the numbered cells, it is reported instead of looked up
+bool Vm::isAddress(double address){
+    if(!std::isnan(address)) return true;
+    runtimeError("Address is not a number.");
+    return false;
 }
+
 InterpretResult Vm::getPointer(){
     Value pointer = pop();
-    const char* name;
-    if(pointer.type == ValueType::POINTER) { push(*pointer.val.pointTo); return InterpretResult::OK; }
-    else if(pointer.type == ValueType::STRING) name = pointer.val.string;
-    else  name = addNumString(pointer.val.number);
+    Value* cell;
+    if(pointer.type() == ValueType::POINTER) { push(*pointer.pointTo()); return InterpretResult::OK; }
+    else if(pointer.type() == ValueType::STRING) cell = stringToPointer(pointer.string());
+    else if(pointer.type() == ValueType::NUMBER) {
+        if(!isAddress(pointer.number())) return InterpretResult::RUNTIME_ERROR;
+        cell = addresses.find(pointer.number());
+    }
+    else cell = nullptr;
 
-    if (has(pMap, name)) {
-        push(*pMap[name]->val.pointTo);
+    if (cell && cell->pointTo()) {
+        push(*cell->pointTo());
     }
-    else { runtimeError("Undefined pointTo %s", name); return InterpretResult::RUNTIME_ERROR; }
+    else { runtimeError("Undefined pointTo %s", std::string(pointer).c_str()); return InterpretResult::RUNTIME_ERROR; }
     return InterpretResult::OK;
 }
 
@@ -241,58 +762,325 @@ InterpretResult Vm::setPointer(bool inverse, bool ispush){
     if(inverse) pointer = pop(), pointee = pop();
     else pointee = pop(), pointer = pop();
 
-    const char* pointerName;
-    if(pointer.type == ValueType::NUMBER) {
-        pointerName = addNumString(pointer.val.number);
-    } else if(pointer.type == ValueType::STRING){
-        pointerName = pointer.val.string;
-    }
-
     Value* actualPointer;
-    if(pointer.type == ValueType::POINTER) actualPointer = &pointer;
+    if(pointer.type() == ValueType::POINTER) actualPointer = &pointer;
+    else if(pointer.type() == ValueType::NUMBER) {
+        if(!isAddress(pointer.number())) return InterpretResult::RUNTIME_ERROR;
+        actualPointer = &addresses.at(pointer.number());
+        if(pointee.type() != ValueType::NUMBER) aliasedAddresses = true;
+    }
+    else if(pointer.type() != ValueType::STRING) {
+        runtimeError("Expected pointer name got %s", std::string(pointer).c_str());
+        return InterpretResult::RUNTIME_ERROR;
+    }
     else {
-        if(!has(pMap, pointerName)) {
-            actualPointer = addToMemory(Value());
-            pMap[pointerName] = actualPointer;
-        }
-        else actualPointer = pMap[pointerName];
+        Value*& cell = cellFor(pointer.string());
+        if(cell == nullptr && (cell = addToMemory(Value())) == nullptr)
+            return InterpretResult::RUNTIME_ERROR;
+        actualPointer = cell;
     }
 
+    if(pointTo(actualPointer, pointee) == InterpretResult::RUNTIME_ERROR)
+        return InterpretResult::RUNTIME_ERROR;
+
+    if(ispush)
+        push(pointee);
+    return InterpretResult::OK;
+}
 
-    if(pointee.type == ValueType::STRING) {
-        const char* rname =  pointee.val.string;
-        if(!has(pMap, rname)) return InterpretResult::RUNTIME_ERROR;
-        else actualPointer->val.pointTo = pMap[rname];
-    } else if(pointee.type == ValueType::NUMBER){
-        if(actualPointer->val.pointTo == nullptr) actualPointer->val.pointTo = addToMemory(pointee);
-        else *actualPointer->val.pointTo = Value(pointee.val.number);
-    } else if(pointee.type == ValueType::BOXED){
-        actualPointer->val.pointTo = pointee.val.pointTo;
+InterpretResult Vm::pointTo(Value* actualPointer, const Value& pointee){
+    if(pointee.type() == ValueType::STRING) {
+        Value* target = stringToPointer(pointee.string());
+        if(!target) return InterpretResult::RUNTIME_ERROR;
+        else actualPointer->setPointTo(target);
+    } else if(pointee.type() == ValueType::NUMBER){
+        if(actualPointer->pointTo() == nullptr) {
+            actualPointer->setPointTo(addToMemory(pointee));
+            if(actualPointer->pointTo() == nullptr)
+                return InterpretResult::RUNTIME_ERROR;
+        }
+        else *actualPointer->pointTo() = Value(pointee.number());
+    } else if(pointee.type() == ValueType::BOXED){
+        actualPointer->setPointTo(pointee.pointTo());
     } else
         assert(false);
+    return InterpretResult::OK;
+}
 
-    if(ispush)
-        push(pointee);
+// The number a loop parameter points to, as OP_GET_POINTER would read it
+Value* Vm::loopValue(const Value& parameter){
+    Value* cell = parameter.type() == ValueType::NUMBER ? addresses.find(parameter.number())
+                                                      : stringToPointer(parameter.string());
+    if(!cell || !cell->pointTo()) {
+        runtimeError("Undefined pointTo %s", std::string(parameter).c_str());
+        return nullptr;
+    }
+    if(cell->pointTo()->type() != ValueType::NUMBER) {
+        runtimeError("Expected number.");
+        return nullptr;
+    }
+    return cell->pointTo();
+}
+
+InterpretResult Vm::loopPrepare(uint16_t loop){
+    const LoopDescriptor& descriptor = chunk->loops[loop];
+    loopSequences[loop].assign(descriptor.parts.size(), 0);
+    for(auto& part : descriptor.parts){
+        Value* cell;
+        if(part.parameter.type() == ValueType::NUMBER) cell = &addresses.at(part.parameter.number());
+        else {
+            Value*& named = cellFor(part.parameter.string());
+            if(named == nullptr && (named = addToMemory(Value())) == nullptr)
+                return InterpretResult::RUNTIME_ERROR;
+            cell = named;
+        }
+        if(pointTo(cell, Value(part.sequences[0].init)) == InterpretResult::RUNTIME_ERROR)
+            return InterpretResult::RUNTIME_ERROR;
+    }
+    return loopTest(loop);
+}
+
+InterpretResult Vm::loopStep(uint16_t loop){
+    const LoopDescriptor& descriptor = chunk->loops[loop];
+    const std::vector<uint32_t>& sequence = loopSequences[loop];
+    for(size_t i = 0; i < descriptor.parts.size(); i++){
+        Value* value = loopValue(descriptor.parts[i].parameter);
+        if(!value) return InterpretResult::RUNTIME_ERROR;
+        *value = Value(value->number() + descriptor.parts[i].sequences[sequence[i]].step);
+    }
+    return loopTest(loop);
+}
+
+// Pushes whether the body runs again. Parts are checked in order, a part past its end moves on to
+// its next sequence, whose start is not checked, and the loop is over once a last sequence ends.
+InterpretResult Vm::loopTest(uint16_t loop){
+    const LoopDescriptor& descriptor = chunk->loops[loop];
+    std::vector<uint32_t>& sequence = loopSequences[loop];
+    for(size_t i = 0; i < descriptor.parts.size(); i++){
+        const LoopPart& part = descriptor.parts[i];
+        Value* value = loopValue(part.parameter);
+        if(!value) return InterpretResult::RUNTIME_ERROR;
+        if(value->number() < part.sequences[sequence[i]].end) continue;
+        if(++sequence[i] == part.sequences.size()) {
+            push(Value(false));
+            return InterpretResult::OK;
+        }
+        *value = Value(part.sequences[sequence[i]].init);
+    }
+    push(Value(true));
     return InterpretResult::OK;
 }
 
+// Runs every iteration of the loop whose OP_LOOP_PREPARE at `prepare` has just passed its first test on
+// the pool, when analyzeLoop accepts its body and the cells the iterations touch are theirs alone.
+// The parameter is left at the value of the last iteration. False when the loop has to run serially,
+// nothing the program can see has changed then.
+bool Vm::runParallel(uint16_t index, size_t prepare){
+    size_t workers = threads ? threads : std::thread::hardware_concurrency();
+    // the profiler counts the instructions of one thread; with aliases two addresses can be the same cell
+    if(workers < 2 || profiler || aliasedAddresses) return false;
+    ParallelLoop& loop = parallelLoops[index];
+    if(!loop.analyzed || loop.prepare != prepare) {
+        loop = ParallelLoop();
+        loop.independent = analyzeLoop(*chunk, prepare, loop);
+        loop.analyzed = true;
+    }
+    if(!loop.independent) return false;
+
+    const LoopSequence& sequence = chunk->loops[index].parts[0].sequences[0];
+    Value* parameter = slots[loop.parameter]->pointTo();
+    size_t count = 0;
+    for(double value = parameter->number(); value < sequence.end; value += sequence.step)
+        if(++count > ParallelLoop::MAX_ITERATIONS) return false;
+    if(count < ParallelLoop::MIN_ITERATIONS) return false;
+    // named cells are only read, and read as numbers so the body can't stop on an error
+    for(uint32_t slot : loop.slotsRead)
+        if(!slots[slot] || !slots[slot]->pointTo() || slots[slot]->pointTo()->type() != ValueType::NUMBER) return false;
+    for(uint32_t slot : loop.namesPrinted) // one without a cell prints its name
+        if(slots[slot] && (!slots[slot]->pointTo() || slots[slot]->pointTo()->type() != ValueType::NUMBER)) return false;
+
+    // The address of every access in every iteration. No two iterations write the same cell when the
+    // addresses of each write keep going up or down, and no iteration touches a cell another one writes
+    // when every other access stays out of the range of a write or has its address in each iteration.
+    // A numbered cell written for the first time gets its value before the workers start, unless a
+    // condition could skip the write. Cells are only looked up here, a loop that runs serially after
+    // all leaves none behind; the new ones are made once the loop is known to run on the workers.
+    struct Range {
+        double previous, low, high;
+        int direction; // of a write's addresses, 0 until the second iteration
+    };
+    size_t accesses = loop.accesses.size();
+    std::vector<Range> ranges(accesses);
+    std::vector<char> together(accesses * accesses, 1); // the same address in every iteration
+    std::vector<double> at(accesses);
+    size_t pieces = std::min(workers * 4, count);
+    size_t perPiece = (count + pieces - 1) / pieces;
+    std::vector<double> starts;
+    std::vector<double> fresh; // addresses of cells written for the first time
+    double value = parameter->number(), last = value;
+    for(size_t k = 0; k < count; k++, value += sequence.step){
+        if(k % perPiece == 0) starts.push_back(value);
+        last = value;
+        for(size_t i = 0; i < accesses; i++){
+            const LoopAccess& access = loop.accesses[i];
+            double address = at[i] = evaluate(loop, access.address, value, slots);
+            if(address != address) return false; // NaN
+            Range& range = ranges[i];
+            if(k == 0) range = Range{address, address, address, 0};
+            else {
+                int direction = address > range.previous ? 1 : address < range.previous ? -1 : 0;
+                if(access.write && (direction == 0 || (range.direction != 0 && direction != range.direction))) return false;
+                range.direction = direction;
+                range.previous = address;
+                range.low = std::min(range.low, address);
+                range.high = std::max(range.high, address);
+            }
+            for(size_t j = 0; j < i; j++) together[i * accesses + j] &= at[j] == address;
+            if(access.write) {
+                Value* cell = addresses.find(address);
+                if(cell && cell->pointTo()) continue;
+                if(access.conditional) return false;
+                fresh.push_back(address);
+            } else {
+                Value* cell = addresses.find(address);
+                if(!cell || !cell->pointTo() || cell->pointTo()->type() != ValueType::NUMBER) return false;
+            }
+        }
+    }
+    for(size_t i = 0; i < accesses; i++)
+        for(size_t j = 0; j < i; j++){
+            if(!loop.accesses[i].write && !loop.accesses[j].write) continue;
+            bool apart = ranges[i].high < ranges[j].low || ranges[j].high < ranges[i].low;
+            if(!apart && !together[i * accesses + j]) return false;
+        }
+    if(memory.getLimit() != 0 && memory.size() + fresh.size() > memory.getLimit()) return false; // serially it stops on the error
+    struct Printed {
+        FILE* out;
+        char* text;
+        size_t size;
+    };
+    std::vector<Printed> printed(starts.size(), Printed{nullptr, nullptr, 0});
+    for(auto& piece : printed)
+        if(!(piece.out = open_memstream(&piece.text, &piece.size))) {
+            for(auto& opened : printed)
+                if(opened.out) {
+                    fclose(opened.out);
+                    free(opened.text);
+                }
+            return false;
+        }
+    for(double address : fresh){
+        Value& cell = addresses.at(address);
+        if(!cell.pointTo()) cell.setPointTo(memory.allocate(Value(0.0)));
+    }
+
+    if(!pool) pool.reset(new ThreadPool(workers));
+    for(size_t piece = 0; piece < starts.size(); piece++){
+        size_t iterations = std::min(perPiece, count - piece * perPiece);
+        pool->submit([this, &loop, &starts, &printed, &sequence, piece, iterations]{
+            std::unique_ptr<Vm> worker(new Vm(*this, loop, printed[piece].out));
+            worker->runIterations(loop, starts[piece], sequence.step, iterations);
+        });
+    }
+    pool->wait();
+    for(auto& piece : printed){
+        fclose(piece.out);
+        fwrite(piece.text, 1, piece.size, out);
+        free(piece.text);
+    }
+    *parameter = Value(last);
+    return true;
+}
+
+// The handlers of run() on a stack of its own, printing into `out`. The worker reads and writes the cells
+// of `owner`, but for the loop's parameter, which is a cell of its own.
+Vm::Vm(Vm& owner, const ParallelLoop& loop, FILE* out): chunk(owner.chunk), code(loop.code.data()),
+    constants(owner.constants), out(out), errors(owner.errors), addresses(owner.addresses), slots(owner.slots) {
+    slots[loop.parameter] = addToMemory(Value());
+    slots[loop.parameter]->setPointTo(addToMemory(Value(0.0)));
+}
+
+// Each iteration starts on an empty stack at the body and ends on the OP_PART_END put in for the step
+void Vm::runIterations(const ParallelLoop& loop, double first, double step, size_t count){
+    Value* parameter = slots[loop.parameter]->pointTo();
+    for(size_t n = 0; n < count; n++, first += step){
+        *parameter = Value(first);
+        stackCount = 0;
+        ip = loop.body - loop.step; // in the worker's code, which starts at the step
+        run();
+    }
+}
+
 //#undef DEBUG_H
-InterpretResult Vm::interpret(const char *source) {
+bool Vm::compile(const char *source, size_t length, Chunk& codeChunk) {
+    if(!compiler.compile(source, length, &codeChunk)) return false;
+    link(codeChunk);
+    return true;
+}
+
+bool Vm::compile(FILE* source, Chunk& codeChunk) {
+    if(!compiler.compile(source, &codeChunk)) return false;
+    link(codeChunk);
+    return true;
+}
+
+void Vm::link(Chunk& codeChunk) {
+    codeChunk.resolveLabels();
+    if(optimizeCode) optimize(codeChunk);
+    codeChunk.finalize();
+}
+
+// A stream is compiled while it is read and run once it ends, without a key for the cache
+InterpretResult Vm::interpret(FILE* source) {
     Chunk codeChunk;
-    if(!compiler.compile(source, &codeChunk)) return InterpretResult::COMPILE_ERROR;
+    if(!compile(source, codeChunk)) return InterpretResult::COMPILE_ERROR;
+    return interpret(codeChunk);
+}
+
+// The chunk only depends on the source and the optimize flag, so one compiled before is run again
+InterpretResult Vm::interpret(const char *source, size_t length) {
+    CompileCache::Key key = CompileCache::keyOf(source, length, optimizeCode);
+    std::shared_ptr<Chunk> codeChunk = compileCache.find(key);
+    if(!codeChunk) {
+        codeChunk = std::make_shared<Chunk>();
+        if(!compile(source, length, *codeChunk)) return InterpretResult::COMPILE_ERROR;
+        compileCache.insert(key, codeChunk);
+    }
+    return interpret(*codeChunk);
+}
+
+InterpretResult Vm::interpret(Chunk& codeChunk) {
+    codeChunk.finalize();
     this->chunk = &codeChunk;
+    code = codeChunk.code.data();
+    constants = codeChunk.constants.data();
+    RegisterCode registerCode;
+    // the profiler counts stack instructions, a profiled chunk always runs on the stack VM
+    if(backend == Backend::REGISTER && !profiler && allocateRegisters(codeChunk, registerCode)) registers = &registerCode;
 #ifdef DEBUG_H
-    disassembleInstructions(this->chunk);
+    if(registers && disassemble) disassembleRegisters(this->chunk, registers);
+    else if(disassemble) disassembleInstructions(this->chunk);
 #endif
     programFinished = false;
-    InterpretResult result = run();
+    bindSlots();
+    loopSequences.assign(codeChunk.loops.size(), {});
+    parallelLoops.assign(codeChunk.loops.size(), ParallelLoop());
+    ip = 0;
+    InterpretResult result = InterpretResult::RUNTIME_ERROR;
+    if(profiler) profiler->begin(codeChunk);
+    if(stackFits()) result = registers ? runRegisters() : run();
+    if(profiler) profiler->end();
+    unbindSlots();
+    registers = nullptr;
     this->chunk = nullptr;
+    code = nullptr;
+    constants = nullptr;
     return result;
 }
 
 bool Vm::isFalsey(Value value) {
-    return value.type == ValueType::NUMBER  && value.val.number != 0 ||
-           value.type == ValueType::BOOL  && !value.val.boolean;
+    return value.type() == ValueType::NUMBER  && value.number() != 0 ||
+           value.type() == ValueType::BOOL  && !value.boolean();
 }
 
 